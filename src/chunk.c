@@ -10,12 +10,16 @@ void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = nullptr;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = nullptr;
   initValueArray(&chunk->constants);
   initLineArray(&chunk->lines);
 }
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   freeValueArray(&chunk->constants);
   freeLineArray(&chunk->lines);
   initChunk(chunk);
@@ -34,7 +38,7 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   chunk->count++;
 }
 
-static ConstRef makeConstRef(int index) {
+ConstRef makeConstRef(int index) {
   if (index < 256) {
     ConstRef ref = {.type = CONST, {.constant = index}};
     return ref;
@@ -58,6 +62,23 @@ ConstRef addConstant(Chunk *chunk, Value value) {
   return makeConstRef(chunk->constants.count - 1);
 }
 
+int addInlineCache(Chunk *chunk, int selector) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  cache->state = CACHE_UNINITIALIZED;
+  cache->selector = selector;
+  cache->count = 0;
+  vm.cacheSites[CACHE_UNINITIALIZED]++;
+
+  return chunk->cacheCount++;
+}
+
 int getLine(Chunk *chunk, int offset) {
   return getInstructionLine(&chunk->lines, offset);
 }
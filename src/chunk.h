@@ -59,14 +59,64 @@ typedef enum {
   OP_METHOD_LONG,
   OP_INIT,
   OP_INHERIT,
+  // Superinstructions. The compiler writes one over the opcode of the first
+  // instruction in a sequence and leaves the rest of the bytes alone, so
+  // the handler skips the opcodes it stands for and reads their operands
+  // where they always were.
+  OP_GET_LOCAL_2,
+  OP_GET_LOCAL_PROP,
+  OP_ADD_LOCAL_CONSTANT,
+  OP_SUBTRACT_LOCAL_CONSTANT,
+  OP_LESS_LOCAL_CONSTANT,
+  OP_EQUAL_JUMP,
+  OP_GREATER_JUMP,
+  OP_LESS_JUMP,
+  // Quickened instructions. The VM writes one over a generic instruction
+  // once it has seen what the instruction works on, and writes the generic
+  // one back when its guard fails.
+  OP_ADD_NUM,
+  OP_GET_PROP_CACHED,
+  OP_SET_PROP_CACHED,
 } OpCode;
 
+#define CACHE_ENTRIES 4
+
+typedef enum {
+  CACHE_UNINITIALIZED,
+  CACHE_MONOMORPHIC,
+  CACHE_POLYMORPHIC,
+  CACHE_MEGAMORPHIC,
+} CacheState;
+
+// What a property site learned about one receiver class: the slot where the
+// field was last found in an instance's table, and the method resolved on
+// the class.
+typedef struct {
+  ObjClass *klass;
+  Obj *method;
+  int slot;
+} CacheEntry;
+
+// Per-instruction cache holding up to CACHE_ENTRIES receiver classes. Sites
+// seeing more classes than that turn megamorphic and stop adding entries.
+// The selector of the property name is fixed by the compiler, -1 for sites
+// that only ever read or write fields.
+typedef struct {
+  CacheState state;
+  int selector;
+  int count;
+  CacheEntry entries[CACHE_ENTRIES];
+} InlineCache;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
   LineArray lines;
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;
 
 typedef enum {
@@ -98,7 +148,9 @@ typedef struct {
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+ConstRef makeConstRef(int index);
 ConstRef addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk, int selector);
 int getLine(Chunk *chunk, int offset);
 
 #endif
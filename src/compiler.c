@@ -230,6 +230,15 @@ static void emitOpAndConstant(ConstRef ref, uint8_t opIfByte,
   }
 }
 
+static void emitCache(int selector) {
+  int index = addInlineCache(currentChunk(), selector);
+  if (index > UINT16_MAX)
+    error("Too many property accesses in one function.");
+
+  emitByte((index >> 8) & 0xff);
+  emitByte(index & 0xff);
+}
+
 static ConstRef emitConstant(Value value) {
   ConstRef ref = makeConstant(value);
   emitOpAndConstant(ref, OP_CONSTANT, OP_CONSTANT_LONG);
@@ -284,10 +293,258 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   writeLocalArray(&current->locals, local);
 }
 
+static int readShort(Chunk *chunk, int offset) {
+  return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+// How many values the instruction at offset leaves on the stack compared
+// to before it, and how many bytes it takes up
+static int stackEffect(Chunk *chunk, int offset, int *length) {
+  switch (chunk->code[offset]) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    *length = 1;
+    return 1;
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_CLASS:
+    *length = 2;
+    return 1;
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_CLASS_LONG:
+    *length = 3;
+    return 1;
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_CMP:
+  case OP_RETURN:
+    *length = 1;
+    return 0;
+  case OP_SET_LOCAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_UPVALUE:
+    *length = 2;
+    return 0;
+  case OP_SET_GLOBAL_LONG:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    *length = 3;
+    return 0;
+  case OP_GET_PROP:
+    *length = 4;
+    return 0;
+  case OP_GET_PROP_LONG:
+    *length = 5;
+    return 0;
+  case OP_POP:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_INIT:
+  case OP_INHERIT:
+    *length = 1;
+    return -1;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_SUPER:
+  case OP_METHOD:
+    *length = 2;
+    return -1;
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_PROP_STR:
+  case OP_GET_SUPER_LONG:
+  case OP_METHOD_LONG:
+    *length = 3;
+    return -1;
+  case OP_SET_PROP:
+    *length = 4;
+    return -1;
+  case OP_SET_PROP_LONG:
+    *length = 5;
+    return -1;
+  case OP_SET_PROP_STR:
+    *length = 1;
+    return -2;
+  case OP_CALL:
+    *length = 2;
+    return -chunk->code[offset + 1];
+  case OP_INVOKE:
+    *length = 5;
+    return -chunk->code[offset + 2];
+  case OP_INVOKE_LONG:
+    *length = 6;
+    return -chunk->code[offset + 3];
+  case OP_SUPER_INVOKE:
+    *length = 5;
+    return -chunk->code[offset + 2] - 1;
+  case OP_SUPER_INVOKE_LONG:
+    *length = 6;
+    return -chunk->code[offset + 3] - 1;
+  case OP_CLOSURE: {
+    Value fun = chunk->constants.values[chunk->code[offset + 1]];
+    *length = 2 + 2 * AS_FUNCTION(fun)->upvalueCount;
+    return 1;
+  }
+  case OP_CLOSURE_LONG: {
+    Value fun = chunk->constants.values[readShort(chunk, offset + 1)];
+    *length = 3 + 2 * AS_FUNCTION(fun)->upvalueCount;
+    return 1;
+  }
+  default: // Unreachable
+    *length = 1;
+    return 0;
+  }
+}
+
+// The deepest the stack gets above the function's first slot. The compiler
+// brings every path to an instruction there with the same stack, so each
+// instruction only needs a visit, starting from the code and each jump
+// target. Code that no path reaches is never looked at.
+static int maxStackDepth(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  int *depths = malloc(sizeof(int) * chunk->count);
+  int *pending = malloc(sizeof(int) * chunk->count);
+  for (int i = 0; i < chunk->count; i++)
+    depths[i] = -1;
+
+  int pendingCount = 0;
+  int maxDepth = function->arity + 1;
+  depths[0] = maxDepth;
+  pending[pendingCount++] = 0;
+
+  while (pendingCount > 0) {
+    int offset = pending[--pendingCount];
+    int depth = depths[offset];
+
+    for (;;) {
+      uint8_t instruction = chunk->code[offset];
+      int length;
+      depth += stackEffect(chunk, offset, &length);
+      if (depth > maxDepth)
+        maxDepth = depth;
+
+      int next = offset + length;
+      int target = -1;
+      if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE)
+        target = next + readShort(chunk, offset + 1);
+      else if (instruction == OP_LOOP)
+        target = next - readShort(chunk, offset + 1);
+
+      if (target != -1 && depths[target] == -1) {
+        depths[target] = depth;
+        pending[pendingCount++] = target;
+      }
+
+      if (instruction == OP_JUMP || instruction == OP_LOOP ||
+          instruction == OP_RETURN || next >= chunk->count ||
+          depths[next] != -1)
+        break;
+
+      depths[next] = depth;
+      offset = next;
+    }
+  }
+
+  free(depths);
+  free(pending);
+
+  return maxDepth;
+}
+
+static bool isOpAt(Chunk *chunk, int offset, uint8_t instruction) {
+  return offset < chunk->count && chunk->code[offset] == instruction;
+}
+
+// The superinstruction for a local, a number constant and then instruction,
+// or -1 if there is none
+static int localConstantOp(uint8_t instruction) {
+  switch (instruction) {
+  case OP_ADD:
+    return OP_ADD_LOCAL_CONSTANT;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_LOCAL_CONSTANT;
+  case OP_LESS:
+    return OP_LESS_LOCAL_CONSTANT;
+  default:
+    return -1;
+  }
+}
+
+// The superinstruction for a comparison followed by a conditional jump
+static uint8_t compareJumpOp(uint8_t instruction) {
+  switch (instruction) {
+  case OP_EQUAL:
+    return OP_EQUAL_JUMP;
+  case OP_GREATER:
+    return OP_GREATER_JUMP;
+  default:
+    return OP_LESS_JUMP;
+  }
+}
+
+// Writes superinstructions over the sequences that DEBUG_OPCODE_STATS builds
+// found running most often in bench/. Only the first opcode of a sequence
+// changes, so offsets, lines and jumps into the middle of it still hold.
+static void fuseInstructions(Chunk *chunk) {
+  uint8_t *code = chunk->code;
+
+  for (int offset = 0; offset < chunk->count;) {
+    int length;
+    stackEffect(chunk, offset, &length);
+    int next = offset + length;
+
+    switch (code[offset]) {
+    case OP_GET_LOCAL:
+      if (isOpAt(chunk, next, OP_CONSTANT) && next + 2 < chunk->count &&
+          IS_NUMBER(chunk->constants.values[code[next + 1]]) &&
+          localConstantOp(code[next + 2]) != -1) {
+        code[offset] = localConstantOp(code[next + 2]);
+        next += 3;
+      } else if (isOpAt(chunk, next, OP_GET_PROP)) {
+        code[offset] = OP_GET_LOCAL_PROP;
+        next += 4;
+      } else if (isOpAt(chunk, next, OP_GET_LOCAL)) {
+        code[offset] = OP_GET_LOCAL_2;
+        next += 2;
+      }
+      break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+      // Only with the POP after the jump, which every condition has
+      if (isOpAt(chunk, next, OP_JUMP_IF_FALSE) &&
+          isOpAt(chunk, next + 3, OP_POP)) {
+        code[offset] = compareJumpOp(code[offset]);
+        next += 4;
+      }
+      break;
+    default:
+      break;
+    }
+
+    offset = next;
+  }
+}
+
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
 
+  if (!parser.hadError) {
+    function->maxStack = maxStackDepth(function);
+    fuseInstructions(&function->chunk);
+  }
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     if (function->name != nullptr) {
@@ -344,6 +601,17 @@ static ConstRef identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(borrowString(name->start, name->length)));
 }
 
+static ConstRef globalRef(Token *name) {
+  int slot = globalSlot(borrowString(name->start, name->length));
+  if (slot > UINT16_MAX)
+    error("Too many global variables.");
+  return makeConstRef(slot);
+}
+
+static int selectorOf(Token *name) {
+  return methodSelector(borrowString(name->start, name->length));
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   if (a->length != b->length)
     return false;
@@ -436,7 +704,7 @@ static VariableRef parseVariable(const char *errorMessage) {
 
   if (current->scopeDepth == 0) {
     ref.type = VAR_GLOBAL;
-    ref.as.global = identifierConstant(&parser.previous);
+    ref.as.global = globalRef(&parser.previous);
   } else {
     ref.type = VAR_LOCAL;
     declareVariable(&parser.previous, ref.readonly);
@@ -533,12 +801,13 @@ static void function(FunctionType type) {
 
     uint8_t argCout = argumentList();
 
-    ConstRef superclass = makeConstant(OBJ_VAL(currentClass->superclass));
+    ConstRef superclass = makeConstRef(globalSlot(currentClass->superclass));
     emitOpAndConstant(superclass, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG);
 
     ConstRef ref = makeConstant(OBJ_VAL(vm.initString));
     emitOpAndConstant(ref, OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG);
     emitByte(argCout);
+    emitCache(methodSelector(vm.initString));
     emitByte(OP_POP);
   }
 
@@ -594,6 +863,7 @@ static void super_(bool canAssign) {
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
   ConstRef ref = identifierConstant(&parser.previous);
+  int selector = selectorOf(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
 
@@ -602,6 +872,7 @@ static void super_(bool canAssign) {
     namedVariable(syntheticToken("super"), false);
     emitOpAndConstant(ref, OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG);
     emitByte(argCout);
+    emitCache(selector);
   } else {
     namedVariable(syntheticToken("super"), false);
     emitOpAndConstant(ref, OP_GET_SUPER, OP_GET_SUPER_LONG);
@@ -973,7 +1244,11 @@ static void call(bool canAssign) {
 }
 
 static Value parseString(Token token) {
-  return OBJ_VAL(borrowString(token.start + 1, token.length - 2));
+  const char *chars = token.start + 1;
+  int length = token.length - 2;
+  if (fitsSmallString(chars, length))
+    return smallStringVal(chars, length);
+  return OBJ_VAL(borrowString(chars, length));
 }
 
 static void string(bool canAssign) {
@@ -982,17 +1257,21 @@ static void string(bool canAssign) {
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  ConstRef ref = identifierConstant(&parser.previous);
+  Token name = parser.previous;
+  ConstRef ref = identifierConstant(&name);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitOpAndConstant(ref, OP_SET_PROP, OP_SET_PROP_LONG);
+    emitCache(-1);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     emitOpAndConstant(ref, OP_INVOKE, OP_INVOKE_LONG);
     emitByte(argCount);
+    emitCache(selectorOf(&name));
   } else {
     emitOpAndConstant(ref, OP_GET_PROP, OP_GET_PROP_LONG);
+    emitCache(selectorOf(&name));
   }
 }
 
@@ -1006,6 +1285,7 @@ static void accessor(bool canAssign) {
     emitByte(OP_SET_PROP_STR);
   } else {
     emitByte(OP_GET_PROP_STR);
+    emitCache(-1);
   }
 }
 
@@ -1069,7 +1349,7 @@ static void upvalueVariable(int index, bool canAssign) {
 }
 
 static void globalVariable(Token name, bool canAssign) {
-  ConstRef ref = identifierConstant(&name);
+  ConstRef ref = globalRef(&name);
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitOpAndConstant(ref, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG);
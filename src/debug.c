@@ -13,6 +13,7 @@
 
 #include "chunk.h"
 #include "debug.h"
+#include "vm.h"
 
 int debug(const char *format, ...) {
 #ifdef DEBUG
@@ -44,6 +45,80 @@ int trace(const char *format, ...) {
 #endif
 }
 
+static const char *opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROP] = "OP_GET_PROP",
+    [OP_GET_PROP_LONG] = "OP_GET_PROP_LONG",
+    [OP_GET_PROP_STR] = "OP_GET_PROP_STR",
+    [OP_SET_PROP] = "OP_SET_PROP",
+    [OP_SET_PROP_LONG] = "OP_SET_PROP_LONG",
+    [OP_SET_PROP_STR] = "OP_SET_PROP_STR",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_CMP] = "OP_CMP",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_INIT] = "OP_INIT",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_LOCAL_2] = "OP_GET_LOCAL_2",
+    [OP_GET_LOCAL_PROP] = "OP_GET_LOCAL_PROP",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_LESS_LOCAL_CONSTANT] = "OP_LESS_LOCAL_CONSTANT",
+    [OP_EQUAL_JUMP] = "OP_EQUAL_JUMP",
+    [OP_GREATER_JUMP] = "OP_GREATER_JUMP",
+    [OP_LESS_JUMP] = "OP_LESS_JUMP",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_GET_PROP_CACHED] = "OP_GET_PROP_CACHED",
+    [OP_SET_PROP_CACHED] = "OP_SET_PROP_CACHED",
+};
+
+const char *opcodeName(uint8_t opcode) {
+  if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+      opcodeNames[opcode] == nullptr)
+    return "OP_UNKNOWN";
+  return opcodeNames[opcode];
+}
+
 void disassembleChunk(Chunk *chunk, const char *name) {
   debug("== %s ==\n", name);
   for (int offset = 0; offset < chunk->count;) {
@@ -70,6 +145,15 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk,
   return offset + 3;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset,
+                             bool isLong) {
+  int slot = isLong ? (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]
+                    : chunk->code[offset + 1];
+  ObjString *global = globalName(slot);
+  debug("%-16s %4d '%.*s'\n", name, slot, global->length, getCString(global));
+  return offset + (isLong ? 3 : 2);
+}
+
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t codeIndex = chunk->code[offset + 1];
   debug("%-16s %4d '", name, codeIndex);
@@ -86,22 +170,55 @@ static int longConstantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+static int cacheInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 1] << 8) | (chunk->code[offset + 2]));
+  debug("%-16s ic %d\n", name, cache);
+  return offset + 3;
+}
+
+static int cachedInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t codeIndex = chunk->code[offset + 1];
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 2] << 8) | (chunk->code[offset + 3]));
+  debug("%-16s %4d '", name, codeIndex);
+  printValue(chunk->constants.values[codeIndex]);
+  debug("' ic %d\n", cache);
+  return offset + 4;
+}
+
+static int longCachedInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t codeIndex =
+      (uint16_t)((chunk->code[offset + 1] << 8) | (chunk->code[offset + 2]));
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 3] << 8) | (chunk->code[offset + 4]));
+  debug("%-16s %4d '", name, codeIndex);
+  printValue(chunk->constants.values[codeIndex]);
+  debug("' ic %d\n", cache);
+  return offset + 5;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t codeIndex = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
-  debug("%-16s %4d '", name, codeIndex);
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 3] << 8) | (chunk->code[offset + 4]));
+  debug("%-16s (%d args) %4d '", name, argCount, codeIndex);
   printValue(chunk->constants.values[codeIndex]);
-  debug("'\n");
-  return offset + 3;
+  debug("' ic %d\n", cache);
+  return offset + 5;
 }
 
 static int longInvokeInstruction(const char *name, Chunk *chunk, int offset) {
-  uint16_t *codeIndex = (uint16_t *)&chunk->code[offset + 1];
+  uint16_t codeIndex =
+      (uint16_t)((chunk->code[offset + 1] << 8) | (chunk->code[offset + 2]));
   uint8_t argCount = chunk->code[offset + 3];
-  debug("%-16s %4d '", name, *codeIndex);
-  printValue(chunk->constants.values[*codeIndex]);
-  debug("'\n");
-  return offset + 4;
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 4] << 8) | (chunk->code[offset + 5]));
+  debug("%-16s (%d args) %4d '", name, argCount, codeIndex);
+  printValue(chunk->constants.values[codeIndex]);
+  debug("' ic %d\n", cache);
+  return offset + 6;
 }
 
 static int closureParameters(Chunk *chunk, int offset, int codeIndex) {
@@ -164,31 +281,31 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset, false);
   case OP_GET_GLOBAL_LONG:
-    return longConstantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL_LONG", chunk, offset, true);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset, false);
   case OP_DEFINE_GLOBAL_LONG:
-    return longConstantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset, true);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset, false);
   case OP_SET_GLOBAL_LONG:
-    return longConstantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL_LONG", chunk, offset, true);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_PROP:
-    return constantInstruction("OP_GET_PROP", chunk, offset);
+    return cachedInstruction("OP_GET_PROP", chunk, offset);
   case OP_GET_PROP_LONG:
-    return constantInstruction("OP_GET_PROP_LONG", chunk, offset);
+    return longCachedInstruction("OP_GET_PROP_LONG", chunk, offset);
   case OP_GET_PROP_STR:
-    return byteInstruction("OP_GET_PROP_STR", chunk, offset);
+    return cacheInstruction("OP_GET_PROP_STR", chunk, offset);
   case OP_SET_PROP:
-    return constantInstruction("OP_SET_PROP", chunk, offset);
+    return cachedInstruction("OP_SET_PROP", chunk, offset);
   case OP_SET_PROP_LONG:
-    return constantInstruction("OP_SET_PROP_LONG", chunk, offset);
+    return longCachedInstruction("OP_SET_PROP_LONG", chunk, offset);
   case OP_SET_PROP_STR:
     return byteInstruction("OP_SET_PROP_STR", chunk, offset);
   case OP_GET_SUPER:
@@ -253,6 +370,30 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return constantInstruction("OP_INIT", chunk, offset);
   case OP_INHERIT:
     return simpleInstruction("OP_INHERIT", offset);
+  // Superinstructions print with the operands of the first instruction
+  // they stand for; the others follow as they are in the code
+  case OP_GET_LOCAL_2:
+    return byteInstruction("OP_GET_LOCAL_2", chunk, offset);
+  case OP_GET_LOCAL_PROP:
+    return byteInstruction("OP_GET_LOCAL_PROP", chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return byteInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+    return byteInstruction("OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset);
+  case OP_LESS_LOCAL_CONSTANT:
+    return byteInstruction("OP_LESS_LOCAL_CONSTANT", chunk, offset);
+  case OP_EQUAL_JUMP:
+    return simpleInstruction("OP_EQUAL_JUMP", offset);
+  case OP_GREATER_JUMP:
+    return simpleInstruction("OP_GREATER_JUMP", offset);
+  case OP_LESS_JUMP:
+    return simpleInstruction("OP_LESS_JUMP", offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_GET_PROP_CACHED:
+    return cachedInstruction("OP_GET_PROP_CACHED", chunk, offset);
+  case OP_SET_PROP_CACHED:
+    return cachedInstruction("OP_SET_PROP_CACHED", chunk, offset);
   default:
     debug("Unknown opcode %d\n", instruction);
     return offset + 1;
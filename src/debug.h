@@ -5,6 +5,7 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char *opcodeName(uint8_t opcode);
 
 int debug(const char *format, ...);
 int trace(const char *format, ...);
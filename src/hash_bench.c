@@ -0,0 +1,179 @@
+#include "object.h"
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Roughly how many bytes each throughput scenario hashes
+#define BYTES 200000000
+
+// Mirrors the group layout in table.c
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+#define CTRL_EMPTY 0x80
+
+typedef uint32_t (*HashFn)(const char *key, int length);
+
+// Keeps hashes from being optimised away
+static volatile uint32_t sink;
+
+// The byte-at-a-time FNV-1a that hashString used to be
+static uint32_t hashFnv(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+typedef struct {
+  const char *name;
+  HashFn fun;
+} Hasher;
+
+static const Hasher hashers[] = {{"fnv-1a", hashFnv},
+                                 {"hashString", hashString}};
+
+// Identifier-like keys: short, sharing prefixes, differing in a few chars
+static char **newIdentifiers(int count) {
+  char **keys = malloc(sizeof(char *) * count);
+  char buffer[32];
+  for (int i = 0; i < count; i++) {
+    snprintf(buffer, sizeof(buffer), "%s%d", i % 2 ? "field" : "x", i);
+    keys[i] = strdup(buffer);
+  }
+  return keys;
+}
+
+// Long keys that only differ near the end, like lines read from input
+static char **newLongKeys(int count, int length) {
+  char **keys = malloc(sizeof(char *) * count);
+  for (int i = 0; i < count; i++) {
+    keys[i] = malloc(length + 1);
+    for (int j = 0; j < length; j++)
+      keys[i][j] = 'a' + j % 26;
+    snprintf(keys[i] + length - 8, 9, "%08d", i);
+  }
+  return keys;
+}
+
+static void freeKeys(char **keys, int count) {
+  for (int i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+}
+
+static void benchThroughput(const Hasher *hasher, const char *scenario,
+                            char **keys, int count) {
+  long length = 0;
+  for (int i = 0; i < count; i++)
+    length += strlen(keys[i]);
+  long rounds = BYTES / length + 1;
+  uint32_t hash = 0;
+
+  clock_t start = clock();
+  for (long round = 0; round < rounds; round++)
+    for (int i = 0; i < count; i++)
+      hash ^= hasher->fun(keys[i], strlen(keys[i]));
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  long hashes = rounds * count;
+
+  sink = hash;
+  printf("%-12s %-20s %8.2f %10.1f\n", hasher->name, scenario,
+         rounds * length / seconds / 1e9, seconds * 1e9 / hashes);
+}
+
+// Places every key in a table of count / 0.875 slots the way table.c does
+// and reports how many groups a lookup visits, and how many tag matches in
+// those groups turn out to be other keys
+static void benchProbes(const Hasher *hasher, const char *scenario,
+                        char **keys, int count) {
+  int capacity = TABLE_GROUP_WIDTH;
+  while (capacity * 0.875 < count)
+    capacity *= 2;
+  int mask = capacity / TABLE_GROUP_WIDTH - 1;
+  uint8_t *control = malloc(capacity);
+  int *owner = malloc(sizeof(int) * capacity);
+  memset(control, CTRL_EMPTY, capacity);
+
+  for (int i = 0; i < count; i++) {
+    uint32_t hash = hasher->fun(keys[i], strlen(keys[i]));
+    int group = H1(hash) & mask;
+    for (int step = 1;; step++) {
+      int base = group * TABLE_GROUP_WIDTH;
+      int slot = 0;
+      while (slot < TABLE_GROUP_WIDTH && control[base + slot] != CTRL_EMPTY)
+        slot++;
+      if (slot < TABLE_GROUP_WIDTH) {
+        control[base + slot] = H2(hash);
+        owner[base + slot] = i;
+        break;
+      }
+      group = (group + step) & mask;
+    }
+  }
+
+  long groups = 0;
+  long falseMatches = 0;
+  int longest = 0;
+  for (int i = 0; i < count; i++) {
+    uint32_t hash = hasher->fun(keys[i], strlen(keys[i]));
+    int group = H1(hash) & mask;
+    for (int step = 1;; step++) {
+      int base = group * TABLE_GROUP_WIDTH;
+      bool found = false;
+      for (int slot = 0; slot < TABLE_GROUP_WIDTH; slot++) {
+        if (control[base + slot] != H2(hash))
+          continue;
+        if (owner[base + slot] == i)
+          found = true;
+        else
+          falseMatches++;
+      }
+      if (found) {
+        groups += step;
+        if (step > longest)
+          longest = step;
+        break;
+      }
+      group = (group + step) & mask;
+    }
+  }
+
+  printf("%-12s %-20s %8.3f %8d %12.3f\n", hasher->name, scenario,
+         (double)groups / count, longest, (double)falseMatches / count);
+
+  free(control);
+  free(owner);
+}
+
+int main() {
+  int count = 1 << 16;
+  char **identifiers = newIdentifiers(count);
+  char **medium = newLongKeys(count, 32);
+  char **lines = newLongKeys(4096, 200);
+  int hasherCount = sizeof(hashers) / sizeof(hashers[0]);
+
+  printf("%-12s %-20s %8s %10s\n", "hash", "keys", "GB/s", "ns/hash");
+  for (int h = 0; h < hasherCount; h++) {
+    benchThroughput(&hashers[h], "identifiers", identifiers, count);
+    benchThroughput(&hashers[h], "32 byte keys", medium, count);
+    benchThroughput(&hashers[h], "200 byte lines", lines, 4096);
+  }
+
+  printf("\n%-12s %-20s %8s %8s %12s\n", "hash", "keys", "groups", "longest",
+         "false tags");
+  for (int h = 0; h < hasherCount; h++) {
+    benchProbes(&hashers[h], "identifiers", identifiers, count);
+    benchProbes(&hashers[h], "32 byte keys", medium, count);
+    benchProbes(&hashers[h], "200 byte lines", lines, 4096);
+  }
+
+  freeKeys(identifiers, count);
+  freeKeys(medium, count);
+  freeKeys(lines, 4096);
+
+  return EXIT_SUCCESS;
+}
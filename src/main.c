@@ -1,7 +1,14 @@
+// MAP_ANONYMOUS is not part of strict ISO C
+#define _DEFAULT_SOURCE
+
 #include "vm.h"
 #include <err.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static void repl() {
   char line[1024];
@@ -18,61 +25,60 @@ static void repl() {
   interpret(line);
 }
 
-static char *readFile(const char *path) {
-  FILE *file = fopen(path, "rb");
-  if (file == nullptr) {
+// A script mapped read-only. Borrowed strings point into it, so it stays
+// mapped until the VM is freed.
+typedef struct {
+  const char *chars;
+  size_t mappedSize;
+} Source;
+
+static Source mapFile(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
     err(74, "Cannot open file \"%s\"", path);
   }
 
-  if (fseek(file, 0L, SEEK_END) != 0) {
-    if (fclose(file) != 0) {
-      err(74, "Cannot close file '%s' after failing to seek to its end", path);
-    }
-    err(74, "Cannot seek to end of file '%s'", path);
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    err(74, "Cannot get the size of file '%s'", path);
   }
-
-  size_t fileSize = ftell(file);
-
-  if (fseek(file, 0L, SEEK_SET) != 0) {
-    if (fclose(file) != 0) {
-      err(74, "Cannot close file '%s' after failing to seek to its beginning",
-          path);
-    }
-    err(74, "Cannot seek to beginning of file '%s'", path);
+  if (!S_ISREG(info.st_mode)) {
+    errx(74, "Cannot map file '%s', it is not a regular file", path);
   }
 
-  char *buffer = (char *)malloc(fileSize + 1);
-  if (buffer == nullptr) {
+  // The file is mapped over zeroed pages at least one byte longer than it,
+  // so the source always ends in the '\0' the scanner stops at
+  size_t fileSize = info.st_size;
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t mappedSize = (fileSize / pageSize + 1) * pageSize;
+
+  char *chars = mmap(nullptr, mappedSize, PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chars == MAP_FAILED) {
     err(74, "Not enough memory to read file \"%s\"", path);
   }
 
-  size_t bytesRead;
-  if ((bytesRead = fread(buffer, sizeof(char), fileSize, file)) < fileSize) {
-    if (feof(file) != 0) {
-      fprintf(stderr, "EOF encountered while reading file '%s'\n", path);
-    } else if (ferror(file) != 0) {
-      fprintf(stderr, "Error encountered while reading file '%s'\n", path);
-    }
+  if (fileSize > 0 && mmap(chars, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                           fd, 0) == MAP_FAILED) {
+    err(74, "Cannot map file '%s'", path);
+  }
 
-    if (fclose(file) != 0) {
-      err(74, "Cannot close file '%s' after failing to read its content", path);
-    }
-    err(74, "Failed to read file content");
+  if (close(fd) != 0) {
+    err(74, "Cannot close file '%s' after mapping it", path);
   }
 
-  buffer[bytesRead] = '\0';
+  return (Source){.chars = chars, .mappedSize = mappedSize};
+}
 
-  if (fclose(file) != 0) {
-    err(74, "Cannot close file '%s' after reading its content", path);
+static void unmapFile(Source source) {
+  if (source.chars != nullptr && munmap((void *)source.chars,
+                                        source.mappedSize) != 0) {
+    err(74, "Cannot unmap source file");
   }
-
-  return buffer;
 }
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
+static void runFile(const char *source) {
   InterpretResult result = interpret(source);
-  free(source);
 
   switch (result) {
   case INTERPRET_COMPILE_ERROR:
@@ -86,17 +92,20 @@ static void runFile(const char *path) {
 
 int main(int argc, const char *argv[]) {
   initVM();
+  Source source = {.chars = nullptr, .mappedSize = 0};
 
   if (argc == 1) {
     repl();
   } else if (argc == 2) {
-    runFile(argv[1]);
+    source = mapFile(argv[1]);
+    runFile(source.chars);
   } else {
     fprintf(stderr, "Usage: clox [path]\n");
     exit(64);
   }
 
   freeVM();
+  unmapFile(source);
 
   return EXIT_SUCCESS;
 }
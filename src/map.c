@@ -0,0 +1,265 @@
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <string.h>
+
+// Each level of the trie consumes MAP_BITS of the key's hash
+#define MAP_BITS 5
+#define MAP_MASK ((1 << MAP_BITS) - 1)
+#define HASH_BITS 32
+
+// Once the whole hash is used up the keys in a node all share it, and the
+// node is a plain list of colliding pairs without a bitmap
+static inline bool isCollision(int shift) { return shift >= HASH_BITS; }
+
+static inline bool isChild(MapSlot *slot) { return IS_UNDEFINED(slot->key); }
+
+static inline uint32_t fragment(uint32_t hash, int shift) {
+  return 1u << ((hash >> shift) & MAP_MASK);
+}
+
+static inline int slotIndex(uint32_t bitmap, uint32_t bit) {
+  return __builtin_popcount(bitmap & (bit - 1));
+}
+
+static uint32_t hashBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static uint32_t hashKey(Value key) {
+  if (IS_STRING(key))
+    return stringHash(AS_STRING(key));
+  if (IS_NUMBER(key)) {
+    // -0 and 0 are the same key
+    double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashBits(bits);
+  }
+  if (IS_SMALL_STRING(key))
+    return hashBits(AS_SMALL_STRING(key));
+  if (IS_OBJ(key))
+    return hashBits((uintptr_t)AS_OBJ(key));
+  if (IS_BOOL(key))
+    return AS_BOOL(key) ? 1 : 2;
+  return 0;
+}
+
+static ObjMapNode *insertSlot(ObjMapNode *node, uint32_t bitmap, int index,
+                              Value key, Value value) {
+  int count = node == nullptr ? 0 : node->count;
+  ObjMapNode *copy = newMapNode(bitmap, count + 1);
+  if (node != nullptr) {
+    memcpy(copy->slots, node->slots, sizeof(MapSlot) * index);
+    memcpy(&copy->slots[index + 1], &node->slots[index],
+           sizeof(MapSlot) * (count - index));
+  }
+  copy->slots[index] = (MapSlot){.key = key, .value = value};
+  return copy;
+}
+
+static ObjMapNode *replaceSlot(ObjMapNode *node, int index, Value key,
+                               Value value) {
+  ObjMapNode *copy = newMapNode(node->bitmap, node->count);
+  memcpy(copy->slots, node->slots, sizeof(MapSlot) * node->count);
+  copy->slots[index] = (MapSlot){.key = key, .value = value};
+  return copy;
+}
+
+// Returns nullptr when the last slot goes
+static ObjMapNode *removeSlot(ObjMapNode *node, uint32_t bitmap, int index) {
+  if (node->count == 1)
+    return nullptr;
+
+  ObjMapNode *copy = newMapNode(bitmap, node->count - 1);
+  memcpy(copy->slots, node->slots, sizeof(MapSlot) * index);
+  memcpy(&copy->slots[index], &node->slots[index + 1],
+         sizeof(MapSlot) * (node->count - index - 1));
+  return copy;
+}
+
+// Points slot index of node at child. The child isn't reachable yet, so it
+// is kept on the stack while the copy is allocated.
+static ObjMapNode *replaceChild(ObjMapNode *node, int index,
+                                ObjMapNode *child) {
+  push(OBJ_VAL(child));
+  ObjMapNode *copy = replaceSlot(node, index, UNDEFINED_VAL, OBJ_VAL(child));
+  pop();
+  return copy;
+}
+
+// Builds the subtree holding two pairs whose hashes agree below shift
+static ObjMapNode *mergePairs(int shift, MapSlot first, uint32_t firstHash,
+                              MapSlot second, uint32_t secondHash) {
+  if (isCollision(shift)) {
+    ObjMapNode *node = newMapNode(0, 2);
+    node->slots[0] = first;
+    node->slots[1] = second;
+    return node;
+  }
+
+  uint32_t firstBit = fragment(firstHash, shift);
+  uint32_t secondBit = fragment(secondHash, shift);
+
+  if (firstBit == secondBit) {
+    ObjMapNode *child = mergePairs(shift + MAP_BITS, first, firstHash, second,
+                                   secondHash);
+    push(OBJ_VAL(child));
+    ObjMapNode *node = newMapNode(firstBit, 1);
+    node->slots[0] = (MapSlot){.key = UNDEFINED_VAL, .value = OBJ_VAL(child)};
+    pop();
+    return node;
+  }
+
+  ObjMapNode *node = newMapNode(firstBit | secondBit, 2);
+  int firstIndex = firstBit < secondBit ? 0 : 1;
+  node->slots[firstIndex] = first;
+  node->slots[1 - firstIndex] = second;
+  return node;
+}
+
+static ObjMapNode *nodeSet(ObjMapNode *node, int shift, uint32_t hash,
+                           Value key, Value value, bool *added) {
+  if (isCollision(shift)) {
+    for (int i = 0; i < node->count; i++) {
+      if (valuesEqual(node->slots[i].key, key))
+        return replaceSlot(node, i, key, value);
+    }
+    *added = true;
+    return insertSlot(node, 0, node->count, key, value);
+  }
+
+  uint32_t bit = fragment(hash, shift);
+  uint32_t bitmap = node == nullptr ? 0 : node->bitmap;
+  int index = slotIndex(bitmap, bit);
+
+  if ((bitmap & bit) == 0) {
+    *added = true;
+    return insertSlot(node, bitmap | bit, index, key, value);
+  }
+
+  MapSlot slot = node->slots[index];
+
+  if (isChild(&slot)) {
+    ObjMapNode *child = nodeSet(AS_MAP_NODE(slot.value), shift + MAP_BITS,
+                                hash, key, value, added);
+    return replaceChild(node, index, child);
+  }
+
+  if (valuesEqual(slot.key, key))
+    return replaceSlot(node, index, key, value);
+
+  *added = true;
+  ObjMapNode *child =
+      mergePairs(shift + MAP_BITS, slot, hashKey(slot.key),
+                 (MapSlot){.key = key, .value = value}, hash);
+  return replaceChild(node, index, child);
+}
+
+// Returns node itself when key is absent and nullptr once it is left empty
+static ObjMapNode *nodeRemove(ObjMapNode *node, int shift, uint32_t hash,
+                              Value key) {
+  if (isCollision(shift)) {
+    for (int i = 0; i < node->count; i++) {
+      if (valuesEqual(node->slots[i].key, key))
+        return removeSlot(node, 0, i);
+    }
+    return node;
+  }
+
+  uint32_t bit = fragment(hash, shift);
+  if ((node->bitmap & bit) == 0)
+    return node;
+
+  int index = slotIndex(node->bitmap, bit);
+  MapSlot slot = node->slots[index];
+
+  if (!isChild(&slot)) {
+    if (!valuesEqual(slot.key, key))
+      return node;
+    return removeSlot(node, node->bitmap & ~bit, index);
+  }
+
+  ObjMapNode *child = AS_MAP_NODE(slot.value);
+  ObjMapNode *updated = nodeRemove(child, shift + MAP_BITS, hash, key);
+
+  if (updated == child)
+    return node;
+  if (updated == nullptr)
+    return removeSlot(node, node->bitmap & ~bit, index);
+
+  // A child down to a single pair folds back into this node, so the trie
+  // stays as shallow as the keys require
+  if (updated->count == 1 && !isChild(&updated->slots[0]))
+    return replaceSlot(node, index, updated->slots[0].key,
+                       updated->slots[0].value);
+
+  return replaceChild(node, index, updated);
+}
+
+bool mapGet(ObjMap *map, Value key, Value *value) {
+  uint32_t hash = hashKey(key);
+  ObjMapNode *node = map->root;
+
+  for (int shift = 0; node != nullptr; shift += MAP_BITS) {
+    if (isCollision(shift)) {
+      for (int i = 0; i < node->count; i++) {
+        if (valuesEqual(node->slots[i].key, key)) {
+          *value = node->slots[i].value;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    uint32_t bit = fragment(hash, shift);
+    if ((node->bitmap & bit) == 0)
+      return false;
+
+    MapSlot *slot = &node->slots[slotIndex(node->bitmap, bit)];
+    if (!isChild(slot)) {
+      if (!valuesEqual(slot->key, key))
+        return false;
+      *value = slot->value;
+      return true;
+    }
+
+    node = AS_MAP_NODE(slot->value);
+  }
+
+  return false;
+}
+
+ObjMap *mapSet(ObjMap *map, Value key, Value value) {
+  bool added = false;
+  ObjMapNode *root = nodeSet(map->root, 0, hashKey(key), key, value, &added);
+
+  push(OBJ_VAL(root));
+  ObjMap *result = newMap(root, map->count + (added ? 1 : 0));
+  pop();
+
+  return result;
+}
+
+ObjMap *mapRemove(ObjMap *map, Value key) {
+  if (map->root == nullptr)
+    return map;
+
+  ObjMapNode *root = nodeRemove(map->root, 0, hashKey(key), key);
+  if (root == map->root)
+    return map;
+
+  if (root == nullptr)
+    return newMap(nullptr, 0);
+
+  push(OBJ_VAL(root));
+  ObjMap *result = newMap(root, map->count - 1);
+  pop();
+
+  return result;
+}
@@ -0,0 +1,13 @@
+#ifndef clox_map_h
+#define clox_map_h
+
+#include "object.h"
+#include "value.h"
+
+bool mapGet(ObjMap *map, Value key, Value *value);
+// Both return a new map and leave the original untouched; only the nodes on
+// the path to key are copied
+ObjMap *mapSet(ObjMap *map, Value key, Value value);
+ObjMap *mapRemove(ObjMap *map, Value key);
+
+#endif
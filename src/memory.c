@@ -77,6 +77,16 @@ static void markArray(ValueArray *array) {
   }
 }
 
+static void markCaches(Chunk *chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      markObject((Obj *)cache->entries[j].klass);
+      markObject(cache->entries[j].method);
+    }
+  }
+}
+
 static void blackenObject(Obj *obj) {
 #ifdef DEBUG_LOG_GC
   debug("GC:  %p blacken '", (void *)obj);
@@ -94,7 +104,9 @@ static void blackenObject(Obj *obj) {
     ObjClass *klass = (ObjClass *)obj;
     MARK((Obj *)klass->name);
     markObject(klass->init);
-    markTable(&klass->methods);
+    for (int i = 0; i < klass->methodCount; i++) {
+      markObject(klass->methods[i]);
+    }
     break;
   case OBJ_CLOSURE:
     ObjClosure *closure = (ObjClosure *)obj;
@@ -107,17 +119,38 @@ static void blackenObject(Obj *obj) {
     ObjFunction *fun = (ObjFunction *)obj;
     markObject((Obj *)fun->name);
     markArray(&fun->chunk.constants);
+    markCaches(&fun->chunk);
     break;
   case OBJ_INSTANCE:
     ObjInstance *inst = (ObjInstance *)obj;
     MARK((Obj *)inst->klass);
     markTable(&inst->fields);
     break;
+  case OBJ_MAP:
+    markObject((Obj *)((ObjMap *)obj)->root);
+    break;
+  case OBJ_MAP_NODE:
+    ObjMapNode *node = (ObjMapNode *)obj;
+    for (int i = 0; i < node->count; i++) {
+      markValue(node->slots[i].key);
+      markValue(node->slots[i].value);
+    }
+    break;
+  case OBJ_ROPE:
+    ObjRope *rope = (ObjRope *)obj;
+    markValue(rope->left);
+    markValue(rope->right);
+    markObject((Obj *)rope->flat);
+    break;
   case OBJ_UPVALUE:
     markValue(((ObjUpvalue *)obj)->closed);
     break;
   case OBJ_NATIVE:
+    break;
   case OBJ_STRING:
+    ObjString *string = (ObjString *)obj;
+    if (string->isBorrowed)
+      markObject((Obj *)borrowedChars(string)->owner);
     break;
   }
 }
@@ -129,7 +162,7 @@ static void freeObject(Obj *obj) {
     break;
   case OBJ_CLASS:
     ObjClass *klass = (ObjClass *)obj;
-    freeTable(&klass->methods);
+    FREE_ARRAY(Obj *, klass->methods, klass->methodCount);
     FREE(ObjClass, obj);
     break;
   case OBJ_CLOSURE:
@@ -147,9 +180,21 @@ static void freeObject(Obj *obj) {
     freeTable(&inst->fields);
     FREE(ObjInstance, obj);
     break;
+  case OBJ_MAP:
+    FREE(ObjMap, obj);
+    break;
+  case OBJ_MAP_NODE:
+    reallocate(obj,
+               sizeof(ObjMapNode) +
+                   sizeof(MapSlot) * ((ObjMapNode *)obj)->count,
+               0);
+    break;
   case OBJ_NATIVE:
     FREE(ObjNative, obj);
     break;
+  case OBJ_ROPE:
+    FREE(ObjRope, obj);
+    break;
   case OBJ_STRING:
     FREE(ObjString, obj);
     break;
@@ -160,8 +205,8 @@ static void freeObject(Obj *obj) {
 }
 
 static void markRoots() {
-  for (int i = 0; i < vm.stack.count; i++) {
-    markValue(vm.stack.values[i]);
+  for (Value *slot = vm.stack.values; slot < vm.stack.top; slot++) {
+    markValue(*slot);
   }
 
   for (int i = 0; i < vm.frameCount; i++) {
@@ -175,6 +220,8 @@ static void markRoots() {
   }
 
   markTable(&vm.globals);
+  markArray(&vm.globalValues);
+  markTable(&vm.selectors);
   markCompilerRoots();
   markObject((Obj *)vm.initString);
 }
@@ -38,10 +38,58 @@ ObjClass *newClass(ObjString *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   klass->init = nullptr;
-  initTable(&klass->methods);
+  klass->shadowed = false;
+  klass->fieldCount = 0;
+  klass->methods = nullptr;
+  klass->methodBase = 0;
+  klass->methodCount = 0;
   return klass;
 }
 
+void setMethod(ObjClass *klass, int selector, Obj *method) {
+  int end = klass->methodBase + klass->methodCount;
+
+  if (klass->methodCount == 0 || selector < klass->methodBase ||
+      selector >= end) {
+    int base = klass->methodCount == 0 || selector < klass->methodBase
+                   ? selector
+                   : klass->methodBase;
+    int count = (klass->methodCount == 0 || selector >= end ? selector + 1
+                                                            : end) -
+                base;
+
+    Obj **methods = ALLOCATE(Obj *, count);
+    for (int i = 0; i < count; i++)
+      methods[i] = nullptr;
+    for (int i = 0; i < klass->methodCount; i++)
+      methods[klass->methodBase - base + i] = klass->methods[i];
+
+    FREE_ARRAY(Obj *, klass->methods, klass->methodCount);
+    klass->methods = methods;
+    klass->methodBase = base;
+    klass->methodCount = count;
+  }
+
+  klass->methods[selector - klass->methodBase] = method;
+}
+
+void inheritMethods(ObjClass *subclass, ObjClass *superclass) {
+  if (subclass->methodCount == 0 && superclass->methodCount > 0) {
+    Obj **methods = ALLOCATE(Obj *, superclass->methodCount);
+    memcpy(methods, superclass->methods,
+           sizeof(Obj *) * superclass->methodCount);
+    subclass->methods = methods;
+    subclass->methodBase = superclass->methodBase;
+    subclass->methodCount = superclass->methodCount;
+    return;
+  }
+
+  for (int i = 0; i < superclass->methodCount; i++) {
+    if (superclass->methods[i] != nullptr)
+      setMethod(subclass, superclass->methodBase + i, superclass->methods[i]);
+  }
+}
+
 ObjClosure *newClosure(ObjFunction *fun) {
   ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, fun->upvalueCount);
   for (int i = 0; i < fun->upvalueCount; i++) {
@@ -61,7 +109,8 @@ ObjString *newOwnedString(const char *start, size_t length) {
 
   string->length = length;
   string->isBorrowed = false;
-  string->hash = hashString(start, length);
+  string->isHashed = false;
+  string->isInterned = false;
   memcpy((void *)string->content, (void *)start, length);
 
   return string;
@@ -71,18 +120,53 @@ ObjFunction *newFunction() {
   ObjFunction *fun = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   fun->arity = 0;
   fun->upvalueCount = 0;
+  fun->maxStack = 0;
   fun->name = nullptr;
   initChunk(&fun->chunk);
   return fun;
 }
 
+// Instances mostly hold a few fields, and the class's field count usually
+// sizes the table before the first one is set
+static const TablePolicy fieldsPolicy = {
+    .initialCapacity = 4,
+    .maxLoad = 0.75,
+    .growthFactor = 2,
+};
+
 ObjInstance *newInstance(ObjClass *klass) {
   ObjInstance *inst = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   inst->klass = klass;
-  initTable(&inst->fields);
+  initTableWithPolicy(&inst->fields, &fieldsPolicy);
+
+  if (klass->fieldCount > 0) {
+    push(OBJ_VAL(inst));
+    tableReserve(&inst->fields, klass->fieldCount);
+    pop();
+  }
+
   return inst;
 }
 
+ObjMap *newMap(ObjMapNode *root, int count) {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  map->root = root;
+  map->count = count;
+  return map;
+}
+
+ObjMapNode *newMapNode(uint32_t bitmap, int count) {
+  ObjMapNode *node = (ObjMapNode *)allocateObject(
+      sizeof(ObjMapNode) + sizeof(MapSlot) * count, OBJ_MAP_NODE);
+  node->bitmap = bitmap;
+  node->count = count;
+  for (int i = 0; i < count; i++) {
+    node->slots[i].key = NIL_VAL;
+    node->slots[i].value = NIL_VAL;
+  }
+  return node;
+}
+
 ObjNative *newNative(NativeFn fun, int arity) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = fun;
@@ -103,23 +187,117 @@ static void printClosure(ObjClosure *closure) {
   printf(" >");
 }
 
+// Secrets and structure follow wyhash (final version 4): the input is read
+// eight bytes at a time and folded with 64x64->128 bit multiplies, three
+// independent lanes at a time for long strings. Short strings are read as
+// overlapping words so there is no per-byte loop at all.
+static const uint64_t hashSecret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull};
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
 uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  const uint8_t *p = (const uint8_t *)key;
+  size_t remaining = length;
+  uint64_t seed = hashMix(hashSecret[0], hashSecret[1]);
+  uint64_t a, b;
+
+  if (remaining <= 16) {
+    if (remaining >= 4) {
+      size_t middle = (remaining >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + remaining - 4) << 32) |
+          read32(p + remaining - 4 - middle);
+    } else if (remaining > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) |
+          p[remaining - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (remaining > 48) {
+      uint64_t lane1 = seed, lane2 = seed;
+      do {
+        seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+        lane1 = hashMix(read64(p + 16) ^ hashSecret[2], read64(p + 24) ^ lane1);
+        lane2 = hashMix(read64(p + 32) ^ hashSecret[3], read64(p + 40) ^ lane2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= lane1 ^ lane2;
+    }
+    while (remaining > 16) {
+      seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    a = read64(p + remaining - 16);
+    b = read64(p + remaining - 8);
   }
-  return hash;
+
+  unsigned __int128 product =
+      (unsigned __int128)(a ^ hashSecret[1]) * (b ^ seed);
+  uint64_t hash = hashMix((uint64_t)product ^ hashSecret[0] ^ (uint64_t)length,
+                          (uint64_t)(product >> 64) ^ hashSecret[1]);
+  // Tables take their group from the high bits and the tag from the low ones
+  return (uint32_t)(hash ^ (hash >> 32));
 }
 
 StringRef toStringRef(ObjString *string) {
   return (StringRef){.length = string->length, .content = getCString(string)};
 }
 
-ObjString *allocateString(int length, int count, ...) {
+static ObjString *newHashedString(const char *chars, int length,
+                                  uint32_t hash) {
   ObjString *string = (ObjString *)allocateObject(
       sizeof(ObjString) + sizeof(char) * (length + 1), OBJ_STRING);
 
+  memcpy(string->content, chars, length);
+  string->content[length] = '\0';
+  string->length = length;
+  string->isBorrowed = false;
+  string->hash = hash;
+  string->isHashed = true;
+  string->isInterned = false;
+
+  return string;
+}
+
+// Strings up to this long are put together on the stack and looked up in
+// the intern table before anything is allocated
+#define PROBE_MAX_LENGTH 64
+
+// Builds a string from its pieces. When the result is short and already
+// interned, the interned string is returned and nothing is allocated. A
+// miss is not interned, but keeps the hash that was computed for the probe.
+ObjString *allocateString(int length, int count, ...) {
+  char buffer[PROBE_MAX_LENGTH];
+  ObjString *string = nullptr;
+  char *chars = buffer;
+
+  if (length > PROBE_MAX_LENGTH) {
+    string = (ObjString *)allocateObject(
+        sizeof(ObjString) + sizeof(char) * (length + 1), OBJ_STRING);
+    chars = string->content;
+  }
+
   va_list refs;
   va_start(refs, count);
 
@@ -127,32 +305,106 @@ ObjString *allocateString(int length, int count, ...) {
 
   for (int i = 0; i < count; i++) {
     StringRef ref = va_arg(refs, StringRef);
-    memcpy(string->content + offset, ref.content, ref.length);
+    memcpy(chars + offset, ref.content, ref.length);
     offset += ref.length;
   }
 
   va_end(refs);
 
-  string->hash = hashString(string->content, length);
-
-  ObjString *interned =
-      tableFindString(&vm.strings, string->content, length, string->hash);
-
-  if (interned != nullptr) {
-    vm.objects = vm.objects->next;
-    FREE(ObjString, string);
-    return interned;
+  if (string == nullptr) {
+    uint32_t hash = hashString(buffer, length);
+    ObjString *interned = tableFindString(&vm.strings, buffer, length, hash);
+    return interned != nullptr ? interned
+                               : newHashedString(buffer, length, hash);
   }
 
   string->content[length] = '\0';
   string->length = length;
   string->isBorrowed = false;
+  string->isHashed = false;
+  string->isInterned = false;
 
-  push(OBJ_VAL(string));
-  tableSet(&vm.strings, string, NIL_VAL);
+  return string;
+}
+
+ObjRope *newRope(Value left, Value right, int length) {
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = nullptr;
+  return rope;
+}
+
+// Writes the rope's content into dest, which has room for rope->length
+// chars. Parts are copied back to front so a rope built by appending in a
+// loop, which leans left, only needs a couple of pending entries. The
+// pending list is plain malloc memory so no objects are allocated.
+static void copyRope(ObjRope *rope, char *dest) {
+  int capacity = 8;
+  int count = 0;
+  Value *pending = malloc(sizeof(Value) * capacity);
+  int end = rope->length;
+
+  pending[count++] = OBJ_VAL(rope);
+
+  while (count > 0) {
+    Value part = pending[--count];
+
+    if (IS_ROPE(part) && AS_ROPE(part)->flat == nullptr) {
+      if (count + 2 > capacity) {
+        capacity *= 2;
+        pending = realloc(pending, sizeof(Value) * capacity);
+      }
+      pending[count++] = AS_ROPE(part)->left;
+      pending[count++] = AS_ROPE(part)->right;
+      continue;
+    }
+
+    char small[SMALL_STRING_MAX];
+    StringRef ref = IS_ROPE(part) ? toStringRef(AS_ROPE(part)->flat)
+                                  : textRef(part, small);
+    end -= ref.length;
+    memcpy(dest + end, ref.content, ref.length);
+  }
+
+  free(pending);
+}
+
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != nullptr)
+    return rope->flat;
+
+  ObjString *string = (ObjString *)allocateObject(
+      sizeof(ObjString) + sizeof(char) * (rope->length + 1), OBJ_STRING);
+  copyRope(rope, string->content);
+  string->content[rope->length] = '\0';
+  string->length = rope->length;
+  string->isBorrowed = false;
+  string->isHashed = false;
+  string->isInterned = false;
+
+  rope->flat = string;
+  rope->left = NIL_VAL;
+  rope->right = NIL_VAL;
+
+  return rope->flat;
+}
+
+// Called by valuesEqual when either side is a rope. Callers may already
+// have popped the operands, so they are kept on the stack while flattening.
+bool ropesEqual(Value a, Value b) {
+  if (!IS_TEXT(a) || !IS_TEXT(b) || textLength(a) != textLength(b))
+    return false;
+
+  push(a);
+  push(b);
+  bool equal = stringsEqual(AS_STRING(flattenValue(a)),
+                            AS_STRING(flattenValue(b)));
+  pop();
   pop();
 
-  return string;
+  return equal;
 }
 
 ObjString *borrowString(const char *chars, int length) {
@@ -164,14 +416,117 @@ ObjString *borrowString(const char *chars, int length) {
     return interned;
 
   ObjString *string = (ObjString *)allocateObject(
-      sizeof(ObjString) + sizeof(char *), OBJ_STRING);
+      sizeof(ObjString) + sizeof(BorrowedChars), OBJ_STRING);
 
   string->length = length;
   string->isBorrowed = true;
   string->hash = hash;
-  memcpy((void *)string->content, (void *)&chars, sizeof(char *));
+  string->isHashed = true;
+  string->isInterned = true;
+  borrowedChars(string)->chars = chars;
+  borrowedChars(string)->owner = nullptr;
+
+  push(OBJ_VAL(string));
+  tableSet(&vm.strings, string, NIL_VAL);
+  pop();
+
+  return string;
+}
 
+// A string borrowing length chars of another, from start on. A view of a
+// view borrows from the same owner, so views never chain.
+ObjString *newStringView(ObjString *string, int start, int length) {
+  ObjString *owner = string->isBorrowed ? borrowedChars(string)->owner : string;
+  ObjString *view = (ObjString *)allocateObject(
+      sizeof(ObjString) + sizeof(BorrowedChars), OBJ_STRING);
+
+  view->length = length;
+  view->isBorrowed = true;
+  view->isHashed = false;
+  view->isInterned = false;
+  borrowedChars(view)->chars = getCString(string) + start;
+  borrowedChars(view)->owner = owner;
+
+  return view;
+}
+
+// Returns the canonical copy of a string, making this one canonical when
+// none exists yet. The string must be reachable, as interning can allocate.
+// Views are copied rather than interned, a key should not keep the whole
+// string it was cut out of alive.
+ObjString *internString(ObjString *string) {
+  if (string->isInterned)
+    return string;
+
+  ObjString *interned = tableFindString(&vm.strings, getCString(string),
+                                        string->length, stringHash(string));
+  if (interned != nullptr)
+    return interned;
+
+  if (isStringView(string)) {
+    string = newHashedString(getCString(string), string->length, string->hash);
+    push(OBJ_VAL(string));
+    string->isInterned = true;
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+  }
+
+  string->isInterned = true;
+  tableSet(&vm.strings, string, NIL_VAL);
+
+  return string;
+}
+
+// Looks the rope's characters up before flattening it, so a rope spelling
+// out an interned string never becomes a string object of its own. Either
+// way the rope ends up flat.
+static ObjString *internRope(ObjRope *rope) {
+  if (rope->flat != nullptr)
+    return internString(rope->flat);
+
+  char *chars = malloc(rope->length);
+  copyRope(rope, chars);
+  uint32_t hash = hashString(chars, rope->length);
+  ObjString *string = tableFindString(&vm.strings, chars, rope->length, hash);
+
+  if (string == nullptr) {
+    // Reachable through the rope while it is interned
+    string = newHashedString(chars, rope->length, hash);
+    rope->flat = string;
+    string->isInterned = true;
+    tableSet(&vm.strings, string, NIL_VAL);
+  }
+  free(chars);
+
+  rope->flat = string;
+  rope->left = NIL_VAL;
+  rope->right = NIL_VAL;
+
+  return string;
+}
+
+// Like internString for any text. Small strings only allocate when no
+// string with their chars is interned yet, and ropes are flattened first.
+// The text must be reachable. A copy made for a small string or a view is
+// only held by the weak intern table, so callers that allocate before they
+// are done with the result have to keep it reachable themselves.
+ObjString *internText(Value text) {
+  if (IS_ROPE(text))
+    return internRope(AS_ROPE(text));
+  if (!IS_SMALL_STRING(text))
+    return internString(AS_STRING(text));
+
+  char chars[SMALL_STRING_MAX];
+  int length = smallStringChars(text, chars);
+  uint32_t hash = hashString(chars, length);
+  ObjString *string = tableFindString(&vm.strings, chars, length, hash);
+  if (string != nullptr)
+    return string;
+
+  string = newHashedString(chars, length, hash);
   push(OBJ_VAL(string));
+  string->isInterned = true;
   tableSet(&vm.strings, string, NIL_VAL);
   pop();
 
@@ -224,9 +579,27 @@ void printObject(Value value) {
     printf("%.*s instance", inst->klass->name->length,
            getCString(inst->klass->name));
     break;
+  case OBJ_MAP:
+    printf("<map %d>", AS_MAP(value)->count);
+    break;
+  case OBJ_MAP_NODE:
+    printf("map node");
+    break;
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
+  case OBJ_ROPE:
+    ObjRope *rope = AS_ROPE(value);
+    if (rope->flat != nullptr) {
+      printf("%.*s", rope->flat->length, getCString(rope->flat));
+    } else {
+      // Printing only needs the characters, not a string object
+      char *chars = malloc(rope->length);
+      copyRope(rope, chars);
+      fwrite(chars, sizeof(char), rope->length, stdout);
+      free(chars);
+    }
+    break;
   case OBJ_STRING:
     ObjString *string = AS_STRING(value);
     printf("%.*s", string->length, getCString(string));
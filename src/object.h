@@ -6,6 +6,7 @@
 #include "table.h"
 #include "value.h"
 #include <stdint.h>
+#include <string.h>
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -24,19 +25,35 @@
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+
+#define IS_MAP_NODE(value) isObjType(value, OBJ_MAP_NODE)
+#define AS_MAP_NODE(value) ((ObjMapNode*)AS_OBJ(value))
+
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 
+// Small strings, strings and ropes all read as strings to Lox code
+#define IS_TEXT(value)                                                         \
+  (IS_SMALL_STRING(value) || IS_STRING(value) || IS_ROPE(value))
+
 typedef enum {
   OBJ_BOUND_METHOD,
   OBJ_CLASS,
   OBJ_CLOSURE,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
+  OBJ_MAP,
+  OBJ_MAP_NODE,
   OBJ_NATIVE,
+  OBJ_ROPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
@@ -59,20 +76,47 @@ struct ObjFunction {
   Obj obj;
   int arity;
   int upvalueCount;
+  // The most slots the function uses at once, its arguments included
+  int maxStack;
   Chunk chunk;
   ObjString *name;
 };
 
-// Note: in the case of a borrowed string, the FAM is reinterpreted as a char*
-// This would be better with a union, but that's an extension of GCC that's not in the mainline yet
+// Note: in the case of a borrowed string, the FAM is reinterpreted as
+// BorrowedChars, so it is aligned for the pointers in there. This would be
+// better with a union, but that's an extension of GCC that's not in the
+// mainline yet
+// Strings built at runtime start out unhashed and uninterned. The hash is
+// computed the first time the string is used as a key, and interning only
+// happens when the VM needs a canonical name.
 struct ObjString {
   Obj obj;
   int length;
   uint32_t hash;
   bool isBorrowed;
-  char content[];
+  bool isHashed;
+  bool isInterned;
+  alignas(void *) char content[];
 };
 
+// Strings borrowed from the source have no owner. Substring views borrow
+// from the string they were cut out of, which they keep alive.
+typedef struct {
+  const char *chars;
+  ObjString *owner;
+} BorrowedChars;
+
+// The result of a long concatenation, kept as its two operands until the
+// content is needed. Flattening builds the string once and drops the
+// operands.
+typedef struct {
+  Obj obj;
+  int length;
+  Value left;
+  Value right;
+  ObjString *flat;
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   int stackIndex;
@@ -87,12 +131,21 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+// Methods are stored in an array indexed by selector, covering only the
+// range of selectors from methodBase to methodBase + methodCount - 1
+struct ObjClass {
   Obj obj;
   ObjString *name;
-  Table methods;
+  Obj **methods;
+  int methodBase;
+  int methodCount;
   Obj *init;
-} ObjClass;
+  // Set once an instance stores a field under the name of one of the methods,
+  // which makes inline-cached method lookups invalid for this class
+  bool shadowed;
+  // Most fields seen on one instance, used to pre-size new instances
+  int fieldCount;
+};
 
 typedef struct {
   Obj obj;
@@ -106,6 +159,29 @@ typedef struct {
   Obj* method;
 } ObjBoundMethod;
 
+typedef struct {
+  Value key;
+  Value value;
+} MapSlot;
+
+// A node of the trie behind ObjMap. Bit i of the bitmap is set when the node
+// has a slot for hash fragment i; slots are stored in bit order. A slot whose
+// key is UNDEFINED_VAL points at a child node through its value. Nodes are
+// never modified once filled in, so maps share them freely.
+typedef struct {
+  Obj obj;
+  uint32_t bitmap;
+  int count;
+  MapSlot slots[];
+} ObjMapNode;
+
+// Immutable map; updates return a new map sharing all untouched nodes
+typedef struct {
+  Obj obj;
+  int count;
+  ObjMapNode *root;
+} ObjMap;
+
 typedef struct StringRef {
   int length;
   const char *content;
@@ -113,14 +189,24 @@ typedef struct StringRef {
 
 ObjBoundMethod *newBoundMethod(Value receiver, Obj *method);
 ObjClass *newClass(ObjString *name);
+void setMethod(ObjClass *klass, int selector, Obj *method);
+void inheritMethods(ObjClass *subclass, ObjClass *superclass);
 ObjClosure *newClosure(ObjFunction *fun);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
+ObjMap *newMap(ObjMapNode *root, int count);
+ObjMapNode *newMapNode(uint32_t bitmap, int count);
 ObjNative *newNative(NativeFn fun, int arity);
 ObjString *newOwnedString(const char *start, size_t length);
 ObjString *allocateString(int length, int count, ...);
+ObjRope *newRope(Value left, Value right, int length);
+ObjString *flattenRope(ObjRope *rope);
+bool ropesEqual(Value a, Value b);
 StringRef toStringRef(ObjString *string);
 ObjString *borrowString(const char* chars, int length);
+ObjString *newStringView(ObjString *string, int start, int length);
+ObjString *internString(ObjString *string);
+ObjString *internText(Value text);
 uint32_t hashString(const char *key, int length);
 const char *copyString(ObjString *string);
 void debugString(ObjString *string);
@@ -131,8 +217,62 @@ static inline bool isObjType(Value value, ObjType type) {
   return (IS_OBJ(value) && AS_OBJ(value)->type == type);
 }
 
+static inline Obj *getMethod(ObjClass *klass, int selector) {
+  unsigned int index = (unsigned int)(selector - klass->methodBase);
+  return index < (unsigned int)klass->methodCount ? klass->methods[index]
+                                                  : nullptr;
+}
+
+static inline BorrowedChars *borrowedChars(ObjString *string) {
+  return (BorrowedChars *)string->content;
+}
+
 static inline const char *getCString(ObjString *string) {
-  return string->isBorrowed ? *(char **)string->content : string->content;
+  return string->isBorrowed ? borrowedChars(string)->chars : string->content;
+}
+
+static inline bool isStringView(ObjString *string) {
+  return string->isBorrowed && borrowedChars(string)->owner != nullptr;
+}
+
+static inline uint32_t stringHash(ObjString *string) {
+  if (!string->isHashed) {
+    string->hash = hashString(getCString(string), string->length);
+    string->isHashed = true;
+  }
+  return string->hash;
+}
+
+// Distinct interned strings always differ, anything else compares by content
+static inline bool stringsEqual(ObjString *a, ObjString *b) {
+  if (a == b)
+    return true;
+  if ((a->isInterned && b->isInterned) || a->length != b->length)
+    return false;
+  if (a->isHashed && b->isHashed && a->hash != b->hash)
+    return false;
+  return memcmp(getCString(a), getCString(b), a->length) == 0;
+}
+
+static inline int textLength(Value value) {
+  if (IS_SMALL_STRING(value))
+    return smallStringLength(value);
+  return IS_STRING(value) ? AS_STRING(value)->length : AS_ROPE(value)->length;
+}
+
+// The chars of a small string or a string. Small strings are unpacked into
+// buffer, which needs room for SMALL_STRING_MAX chars.
+static inline StringRef textRef(Value value, char *buffer) {
+  if (IS_SMALL_STRING(value))
+    return (StringRef){.length = smallStringChars(value, buffer),
+                       .content = buffer};
+  ObjString *string = AS_STRING(value);
+  return (StringRef){.length = string->length, .content = getCString(string)};
+}
+
+// Ropes must be reachable while they are flattened, as it allocates
+static inline Value flattenValue(Value value) {
+  return IS_ROPE(value) ? OBJ_VAL(flattenRope(AS_ROPE(value))) : value;
 }
 
 static inline const char *getType(ObjType type) {
@@ -143,8 +283,13 @@ static inline const char *getType(ObjType type) {
     return "class";
   case OBJ_INSTANCE:
     return "instance";
+  case OBJ_MAP:
+    return "map";
+  case OBJ_MAP_NODE:
+    return "map node";
   case OBJ_FUNCTION:
     return "function";
+  case OBJ_ROPE:
   case OBJ_STRING:
     return "string";
   case OBJ_NATIVE:
@@ -0,0 +1,131 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "object.h"
+#include "output.h"
+
+void initOutput(Output *output) { output->count = 0; }
+
+void flushOutput(Output *output) {
+  if (output->count > 0)
+    fwrite(output->chars, sizeof(char), output->count, stdout);
+  output->count = 0;
+}
+
+void writeOutput(Output *output, const char *chars, int length) {
+  if (output->count + length > OUTPUT_BUFFER_SIZE) {
+    flushOutput(output);
+    if (length > OUTPUT_BUFFER_SIZE) {
+      fwrite(chars, sizeof(char), length, stdout);
+      return;
+    }
+  }
+
+  memcpy(output->chars + output->count, chars, length);
+  output->count += length;
+}
+
+static int formatInteger(long integer, char *dest) {
+  char digits[NUMBER_MAX_LENGTH];
+  int count = 0;
+  do {
+    digits[count++] = '0' + integer % 10;
+    integer /= 10;
+  } while (integer > 0);
+
+  for (int i = 0; i < count; i++)
+    dest[i] = digits[count - 1 - i];
+  return count;
+}
+
+static const double powersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                    1e5, 1e6, 1e7, 1e8, 1e9};
+
+// Writes the same characters as printf("%g") without parsing a format.
+// Whole numbers and numbers that %g writes without an exponent are done
+// here; the rest, and the rare case where rounding to six digits is too
+// close to call in doubles, go to snprintf.
+int formatNumber(double number, char *dest) {
+  double magnitude = fabs(number);
+  int length = 0;
+
+  if (signbit(number))
+    dest[length++] = '-';
+
+  if (magnitude < 1e6 && magnitude == floor(magnitude))
+    return length + formatInteger((long)magnitude, dest + length);
+
+  if (!(magnitude >= 1e-4 && magnitude < 1e6))
+    return snprintf(dest, NUMBER_MAX_LENGTH, "%g", number);
+
+  // Six significant digits, the first of them at 10^exponent. The scaling
+  // is exact, so the product is off by at most half an ulp.
+  int exponent = (int)floor(log10(magnitude));
+  if (exponent < -4 || exponent > 5)
+    return snprintf(dest, NUMBER_MAX_LENGTH, "%g", number);
+
+  double scaled = magnitude * powersOf10[5 - exponent];
+  double whole = floor(scaled);
+  double fraction = scaled - whole;
+  if (fabs(fraction - 0.5) < 1e-6)
+    return snprintf(dest, NUMBER_MAX_LENGTH, "%g", number);
+
+  long digits = (long)whole + (fraction > 0.5);
+  if (digits < 100000 || digits >= 1000000)
+    return snprintf(dest, NUMBER_MAX_LENGTH, "%g", number);
+
+  char chars[6];
+  formatInteger(digits, chars);
+
+  int last = 5;
+  while (chars[last] == '0')
+    last--;
+
+  if (exponent >= 0) {
+    memcpy(dest + length, chars, exponent + 1);
+    length += exponent + 1;
+    if (last > exponent) {
+      dest[length++] = '.';
+      memcpy(dest + length, chars + exponent + 1, last - exponent);
+      length += last - exponent;
+    }
+  } else {
+    dest[length++] = '0';
+    dest[length++] = '.';
+    for (int i = -1; i > exponent; i--)
+      dest[length++] = '0';
+    memcpy(dest + length, chars, last + 1);
+    length += last + 1;
+  }
+
+  return length;
+}
+
+// Text, numbers and literals are written straight into the buffer. Other
+// objects are rare in output and are printed the usual way after a flush.
+void writeValue(Output *output, Value value) {
+  if (IS_NUMBER(value)) {
+    char chars[NUMBER_MAX_LENGTH];
+    writeOutput(output, chars, formatNumber(AS_NUMBER(value), chars));
+  } else if (IS_SMALL_STRING(value)) {
+    char chars[SMALL_STRING_MAX];
+    writeOutput(output, chars, smallStringChars(value, chars));
+  } else if (IS_STRING(value)) {
+    ObjString *string = AS_STRING(value);
+    writeOutput(output, getCString(string), string->length);
+  } else if (IS_ROPE(value) && AS_ROPE(value)->flat != nullptr) {
+    ObjString *string = AS_ROPE(value)->flat;
+    writeOutput(output, getCString(string), string->length);
+  } else if (IS_BOOL(value)) {
+    if (AS_BOOL(value))
+      writeOutput(output, "true", 4);
+    else
+      writeOutput(output, "false", 5);
+  } else if (IS_NIL(value)) {
+    writeOutput(output, "nil", 3);
+  } else {
+    flushOutput(output);
+    printValue(value);
+  }
+}
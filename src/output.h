@@ -0,0 +1,26 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+#include "value.h"
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+// Room for any number formatNumber writes
+#define NUMBER_MAX_LENGTH 32
+
+// What print writes, collected so it reaches stdout in large writes. It is
+// flushed when the script ends or fails, when the process exits, and before
+// anything else is written to stdout.
+typedef struct {
+  int count;
+  char chars[OUTPUT_BUFFER_SIZE];
+} Output;
+
+void initOutput(Output *output);
+void flushOutput(Output *output);
+void writeOutput(Output *output, const char *chars, int length);
+void writeValue(Output *output, Value value);
+int formatNumber(double number, char *dest);
+
+#endif
@@ -0,0 +1,46 @@
+#include "output.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// formatNumber must write exactly what printf("%g") writes
+static void check(double number) {
+  char expected[NUMBER_MAX_LENGTH];
+  char actual[NUMBER_MAX_LENGTH];
+  snprintf(expected, sizeof(expected), "%g", number);
+  int length = formatNumber(number, actual);
+  actual[length] = '\0';
+
+  if (strcmp(expected, actual) != 0) {
+    printf("%.17g: expected '%s', got '%s'\n", number, expected, actual);
+    assert(false);
+  }
+}
+
+int main() {
+  double numbers[] = {0,         -0.0,       1,         -1,       10,
+                      999999,    1000000,    -999999,   123456,   0.5,
+                      0.1,       0.2 + 0.1,  1.5,       2.48695,  3.14159265,
+                      999999.5,  999999.49,  99999.95,  0.0001,   0.00009999995,
+                      0.0001234, 1e-5,       1e21,      1.0 / 3,  2.0 / 3,
+                      1e300,     -1e-300,    INFINITY,  -INFINITY, NAN,
+                      4.5,       0.000123455, 1.000005, 1.0000050000001};
+  int count = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (int i = 0; i < count; i++)
+    check(numbers[i]);
+
+  // Decimal fractions, as scripts compute them, and random magnitudes
+  srand(42);
+  for (int i = 0; i < 1000000; i++) {
+    check((rand() % 20000001 - 10000000) / 1000.0);
+    check((rand() % 2000001 - 1000000) / 7.0);
+    check(ldexp((double)rand() / RAND_MAX, rand() % 60 - 30));
+  }
+
+  printf("All tests passed!\n");
+
+  return EXIT_SUCCESS;
+}
@@ -4,20 +4,19 @@
 #include "common.h"
 #include "value.h"
 
+// The stack is allocated once and never moves, so pointers into it stay
+// valid. Frames reserve their slots up to limit when they are called.
 typedef struct {
-  int count;
-  int capacity;
   Value* values;
   Value* top;
+  Value* limit;
 } Stack;
 
-void initStack(Stack* stack);
+void initStack(Stack* stack, int capacity);
 void freeStack(Stack* stack);
 void pushOnStack(Stack* stack, Value value);
 Value popFromStack(Stack* stack);
 Value peekFromStack(Stack* stack, int distance);
-Value stackGet(Stack *stack, int index);
-void stackSet(Stack *stack, int index, Value value);
 void stackReset(Stack *stack, int index);
 void stackDrop(Stack *stack, int count);
 
@@ -5,108 +5,290 @@
 #include <stdio.h>
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const TablePolicy defaultPolicy = {
+    .initialCapacity = 8,
+    .maxLoad = 0.75,
+    .growthFactor = 2,
+};
+
+// Control bytes with the high bit set mark free slots; anything else is the
+// low 7 bits of the hash of the key stored in that slot
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
+// Tables smaller than a group keep their entries packed at the front and
+// are searched linearly, without control bytes
+static inline bool isSmall(int capacity) {
+  return capacity < TABLE_GROUP_WIDTH;
+}
+
+static inline int controlSize(int capacity) {
+  return isSmall(capacity) ? 0 : capacity;
+}
+
+// Bit i of the result is set when byte i of the group equals byte
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    if (group[i] == byte)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+// Empty and deleted slots
+static inline uint32_t matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    if (group[i] & 0x80)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
 
-void initTable(Table *table) {
+static inline int groupMask(int capacity) {
+  return capacity / TABLE_GROUP_WIDTH - 1;
+}
+
+void initTable(Table *table) { initTableWithPolicy(table, &defaultPolicy); }
+
+void initTableWithPolicy(Table *table, const TablePolicy *policy) {
   table->count = 0;
   table->capacity = 0;
+  table->policy = policy;
+  table->control = nullptr;
   table->entries = nullptr;
 }
 
 void freeTable(Table *table) {
+  FREE_ARRAY(uint8_t, table->control, controlSize(table->capacity));
   FREE_ARRAY(Entry, table->entries, table->capacity);
-  initTable(table);
+  initTableWithPolicy(table, table->policy);
+}
+
+static int findSmallEntry(Table *table, uint32_t hash) {
+  for (int i = 0; i < table->count; i++)
+    if (table->entries[i].hash == hash)
+      return i;
+  return -1;
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = nullptr;
+// Returns the slot holding key, or -1 if it is absent. When insert is not
+// nullptr it receives the first free slot along the probe sequence, which is
+// where the key would go.
+static int findEntry(Table *table, ObjString *key, int *insert) {
+  uint32_t hash = stringHash(key);
+
+  if (isSmall(table->capacity)) {
+    if (insert != nullptr)
+      *insert = table->count;
+    return findSmallEntry(table, hash);
+  }
+
+  uint8_t tag = H2(hash);
+  int mask = groupMask(table->capacity);
+  int group = H1(hash) & mask;
+  int firstFree = -1;
 
-  for (;;) {
-    Entry *entry = &entries[index];
+  for (int step = 1;; step++) {
+    const uint8_t *ctrl = &table->control[group * TABLE_GROUP_WIDTH];
+    int base = group * TABLE_GROUP_WIDTH;
 
-    if (entry->key == nullptr) {
-      if (IS_NIL(entry->value)) // Empty entry
-        return tombstone != nullptr ? tombstone : entry;
-      else if (tombstone == nullptr) // Tombstone
-        tombstone = entry;
-    } else if (entry->key->hash == key->hash) { // Found it
-      return entry;
+    for (uint32_t match = matchByte(ctrl, tag); match; match &= match - 1) {
+      int index = base + __builtin_ctz(match);
+      if (table->entries[index].hash == hash)
+        return index;
     }
 
-    index = (index + 1) & (capacity - 1);
+    if (insert != nullptr && firstFree == -1) {
+      uint32_t free = matchFree(ctrl);
+      if (free)
+        firstFree = base + __builtin_ctz(free);
+    }
+
+    if (matchByte(ctrl, CTRL_EMPTY)) {
+      if (insert != nullptr)
+        *insert = firstFree;
+      return -1;
+    }
+
+    // Triangular steps visit every group when the group count is a power of 2
+    group = (group + step) & mask;
   }
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
-  if (table->count == 0)
-    return false;
-
-  Entry *entry = findEntry(table->entries, table->capacity, key);
+  int slot;
+  return tableGetSlot(table, key, value, &slot);
+}
 
-  if (entry == nullptr)
+bool tableGetSlot(Table *table, ObjString *key, Value *value, int *slot) {
+  if (table->count == 0)
     return false;
 
-  if (entry->key == nullptr)
+  int index = findEntry(table, key, nullptr);
+  if (index < 0)
     return false;
 
-  *value = entry->value;
+  *value = table->entries[index].value;
+  *slot = index;
 
   return true;
 }
 
-void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
+// Freshly grown tables have no deleted slots or duplicate keys, so the first
+// empty slot on the probe sequence is where the key belongs
+static int findEmpty(Table *table, uint32_t hash) {
+  if (isSmall(table->capacity))
+    return table->count;
+
+  int mask = groupMask(table->capacity);
+  int group = H1(hash) & mask;
+
+  for (int step = 1;; step++) {
+    uint32_t empty =
+        matchByte(&table->control[group * TABLE_GROUP_WIDTH], CTRL_EMPTY);
+    if (empty)
+      return group * TABLE_GROUP_WIDTH + __builtin_ctz(empty);
+    group = (group + step) & mask;
+  }
+}
 
+void adjustCapacity(Table *table, int capacity) {
+  Table grown;
+  grown.count = 0;
+  grown.capacity = capacity;
+  grown.policy = table->policy;
+  grown.control = nullptr;
+  grown.entries = ALLOCATE(Entry, capacity);
+
+  if (!isSmall(capacity)) {
+    grown.control = ALLOCATE(uint8_t, capacity);
+    memset(grown.control, CTRL_EMPTY, capacity);
+  }
   for (int i = 0; i < capacity; i++) {
-    entries[i].key = nullptr;
-    entries[i].value = NIL_VAL;
+    grown.entries[i].key = nullptr;
+    grown.entries[i].hash = 0;
+    grown.entries[i].value = NIL_VAL;
   }
 
-  table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = &table->entries[i];
     if (entry->key == nullptr)
       continue;
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    int index = findEmpty(&grown, entry->hash);
+    if (grown.control != nullptr)
+      grown.control[index] = H2(entry->hash);
+    grown.entries[index] = *entry;
+    grown.count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-
-  table->entries = entries;
-  table->capacity = capacity;
+  freeTable(table);
+  *table = grown;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
-  }
+  int slot;
+  return tableSetSlot(table, key, value, &slot);
+}
+
+// Tombstones count towards the load, so a full table may be mostly deleted
+// slots; rebuilding it at the same size is enough to clear them
+static int rehashCapacity(Table *table) {
+  int live = 0;
+  for (int i = 0; i < table->capacity; i++)
+    if (table->entries[i].key != nullptr)
+      live++;
+
+  if (live + 1 <= table->capacity * table->policy->maxLoad / 2)
+    return table->capacity;
+  if (table->capacity == 0)
+    return table->policy->initialCapacity;
+  return table->capacity * table->policy->growthFactor;
+}
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == nullptr;
-  if (isNewKey && IS_NIL(entry->value))
-    table->count++;
+bool tableSetSlot(Table *table, ObjString *key, Value value, int *slot) {
+  if (table->count + 1 > table->capacity * table->policy->maxLoad)
+    adjustCapacity(table, rehashCapacity(table));
 
+  int index = findEntry(table, key, slot);
+  bool isNewKey = index < 0;
+  if (isNewKey) {
+    index = *slot;
+    if (isSmall(table->capacity)) {
+      table->count++;
+    } else {
+      // Reusing a deleted slot leaves the count alone, tombstones are counted
+      if (table->control[index] == CTRL_EMPTY)
+        table->count++;
+      table->control[index] = H2(key->hash);
+    }
+  }
+
+  Entry *entry = &table->entries[index];
   entry->key = key;
+  entry->hash = key->hash;
   entry->value = value;
+  *slot = index;
 
   return isNewKey;
 }
 
+void tableReserve(Table *table, int count) {
+  const TablePolicy *policy = table->policy;
+  int capacity =
+      table->capacity == 0 ? policy->initialCapacity : table->capacity;
+  while (count > capacity * policy->maxLoad)
+    capacity *= policy->growthFactor;
+
+  if (capacity > table->capacity)
+    adjustCapacity(table, capacity);
+}
+
 bool tableDelete(Table *table, ObjString *key) {
   if (table->count == 0)
     return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == nullptr)
+  int index = findEntry(table, key, nullptr);
+  if (index < 0)
     return false;
 
+  Entry *entry = &table->entries[index];
+  if (isSmall(table->capacity)) {
+    // Keep the entries packed by moving the last one into the hole
+    Entry *last = &table->entries[--table->count];
+    *entry = *last;
+    entry = last;
+  } else {
+    // Probes only move past a group once it is full, so no key lives beyond
+    // a group that still has an empty slot and the deleted one can be
+    // emptied too
+    int group = index & ~(TABLE_GROUP_WIDTH - 1);
+    if (matchByte(&table->control[group], CTRL_EMPTY)) {
+      table->control[index] = CTRL_EMPTY;
+      table->count--;
+    } else {
+      table->control[index] = CTRL_DELETED;
+    }
+  }
   entry->key = nullptr;
-  entry->value = BOOL_VAL(true); // Tombstone
+  entry->value = NIL_VAL;
   return true;
 }
 
@@ -118,30 +300,48 @@ void tableAddAll(Table *from, Table *to) {
   }
 }
 
+static inline bool isString(Entry *entry, const char *chars, int length,
+                            uint32_t hash) {
+  return entry->hash == hash && entry->key->length == length &&
+         memcmp(getCString(entry->key), chars, length) == 0;
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash) {
   if (table->count == 0)
     return nullptr;
 
-  uint32_t index = hash & (table->capacity - 1);
+  if (isSmall(table->capacity)) {
+    for (int i = 0; i < table->count; i++)
+      if (isString(&table->entries[i], chars, length, hash))
+        return table->entries[i].key;
+    return nullptr;
+  }
 
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == nullptr) {
-      if (IS_NIL(entry->value))
-        return nullptr;
-    } else {
-      if (entry->key->length == length && entry->key->hash == hash &&
-          memcmp(getCString(entry->key), chars, length) == 0)
+  uint8_t tag = H2(hash);
+  int mask = groupMask(table->capacity);
+  int group = H1(hash) & mask;
+
+  for (int step = 1;; step++) {
+    const uint8_t *ctrl = &table->control[group * TABLE_GROUP_WIDTH];
+    int base = group * TABLE_GROUP_WIDTH;
+
+    for (uint32_t match = matchByte(ctrl, tag); match; match &= match - 1) {
+      Entry *entry = &table->entries[base + __builtin_ctz(match)];
+      if (isString(entry, chars, length, hash))
         return entry->key;
     }
 
-    index = (index + 1) & (table->capacity - 1);
+    if (matchByte(ctrl, CTRL_EMPTY))
+      return nullptr;
+
+    group = (group + step) & mask;
   }
 }
 
 void tableRemoveWhite(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
+  // Walk backwards so entries moved down by a delete have been seen already
+  for (int i = table->capacity - 1; i >= 0; i--) {
     Entry *entry = &table->entries[i];
     if (entry->key != nullptr && !IS_MARKED(&entry->key->obj)) {
       tableDelete(table, entry->key);
@@ -152,7 +352,6 @@ void tableRemoveWhite(Table *table) {
 void markTable(Table *table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = &table->entries[i];
-    Obj *key = (Obj *)entry->key;
     markObject((Obj *)entry->key);
     markValue(entry->value);
   }
@@ -165,10 +364,11 @@ void tableDump(Table *table) {
     Entry *entry = &table->entries[i];
     if (entry->key != nullptr) {
       printf("[%d | '%.*s' | %d] -> ", i, entry->key->length,
-             getCString(entry->key), entry->key->hash);
+             getCString(entry->key), entry->hash);
       printValue(entry->value);
       printf("\n");
-    } else if (IS_BOOL(entry->value) && AS_BOOL(entry->value) == true) {
+    } else if (table->control != nullptr &&
+               table->control[i] == CTRL_DELETED) {
       printf("[%d | <tombstone> ]\n", i);
     } else {
       printf("[%d | <empty> ]\n", i);
@@ -3,21 +3,48 @@
 
 #include "value.h"
 
+// The key's hash is kept alongside it so probing and resizing never have
+// to load the string itself
 typedef struct {
   ObjString *key;
+  uint32_t hash;
   Value value;
 } Entry;
 
+// Entries are grouped in runs of TABLE_GROUP_WIDTH slots. Each slot has a
+// control byte holding either 7 bits of the key's hash or an empty/deleted
+// marker, so a whole group can be probed without touching the entries.
+// Tables with fewer slots than a group have no control bytes and keep their
+// entries packed at the front instead.
+#define TABLE_GROUP_WIDTH 16
+
+// How a table sizes itself, chosen by whoever owns it. Capacities must stay
+// powers of 2, so initialCapacity and growthFactor have to be powers of 2.
+typedef struct {
+  int initialCapacity;
+  double maxLoad;
+  int growthFactor;
+} TablePolicy;
+
 typedef struct {
   int count;
   int capacity;
+  const TablePolicy *policy;
+  uint8_t *control;
   Entry *entries;
 } Table;
 
 void initTable(Table *table);
+void initTableWithPolicy(Table *table, const TablePolicy *policy);
 void freeTable(Table *table);
+// Grows the table up front so count keys fit without resizing
+void tableReserve(Table *table, int count);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
+// Slot variants report the index of the entry so callers can cache it; the
+// slot stays valid until the table is resized or the key deleted
+bool tableGetSlot(Table *table, ObjString *key, Value *value, int *slot);
+bool tableSetSlot(Table *table, ObjString *key, Value value, int *slot);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
@@ -0,0 +1,183 @@
+#include "object.h"
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Roughly how many table operations each scenario performs
+#define OPS 4000000
+
+// Keeps lookups from being optimised away
+static volatile int sink;
+
+static ObjString *newString(const char *start) {
+  size_t length = strlen(start);
+  ObjString *string = (ObjString *)malloc(sizeof(ObjString) + length + 1);
+
+  string->length = length;
+  string->isBorrowed = false;
+  string->hash = hashString(start, length);
+  string->isHashed = true;
+  string->isInterned = false;
+  memcpy((void *)string->content, (void *)start, length + 1);
+
+  return string;
+}
+
+static ObjString **newKeys(const char *prefix, int count) {
+  ObjString **keys = malloc(sizeof(ObjString *) * count);
+  char buffer[32];
+  for (int i = 0; i < count; i++) {
+    snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+    keys[i] = newString(buffer);
+  }
+  return keys;
+}
+
+static void freeKeys(ObjString **keys, int count) {
+  for (int i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+}
+
+static double bytesPerEntry(Table *table) {
+  if (table->count == 0)
+    return 0;
+  size_t bytes = sizeof(Entry) * table->capacity;
+  if (table->control != nullptr)
+    bytes += table->capacity;
+  return (double)bytes / table->count;
+}
+
+static void report(const char *scenario, int keys, Table *table, long ops,
+                   clock_t start) {
+  double ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / ops;
+  double load = table->capacity ? (double)table->count / table->capacity : 0;
+  printf("%-24s %8d %6.2f %10.1f %12.1f\n", scenario, keys, load, ns,
+         bytesPerEntry(table));
+}
+
+static void fill(Table *table, ObjString **keys, int count) {
+  for (int i = 0; i < count; i++)
+    tableSet(table, keys[i], NUMBER_VAL(i));
+}
+
+static void benchInsert(int count) {
+  ObjString **keys = newKeys("key", count);
+  int rounds = OPS / count + 1;
+  Table table;
+
+  clock_t start = clock();
+  for (int round = 0; round < rounds; round++) {
+    initTable(&table);
+    fill(&table, keys, count);
+    if (round + 1 < rounds)
+      freeTable(&table);
+  }
+  report("insert", count, &table, (long)rounds * count, start);
+
+  freeTable(&table);
+  freeKeys(keys, count);
+}
+
+// Looks up present and absent keys in turn, hitPercent of them present
+static void benchGet(const char *scenario, int count, int hitPercent) {
+  ObjString **keys = newKeys("key", count);
+  ObjString **misses = newKeys("miss", count);
+  Table table;
+  initTable(&table);
+  fill(&table, keys, count);
+
+  Value value;
+  int found = 0;
+  clock_t start = clock();
+  for (long i = 0; i < OPS; i++) {
+    ObjString *key =
+        i % 100 < hitPercent ? keys[i % count] : misses[i % count];
+    found += tableGet(&table, key, &value);
+  }
+  report(scenario, count, &table, OPS, start);
+
+  sink = found;
+
+  freeTable(&table);
+  freeKeys(keys, count);
+  freeKeys(misses, count);
+}
+
+// Keeps count keys live while sliding over four times as many names, so
+// every insert is a key the table has not held for a while
+static void benchChurn(int count) {
+  int names = count * 4;
+  ObjString **keys = newKeys("churn", names);
+  Table table;
+  initTable(&table);
+  fill(&table, keys, count);
+
+  clock_t start = clock();
+  for (long i = 0; i < OPS / 2; i++) {
+    tableSet(&table, keys[(i + count) % names], NUMBER_VAL(i));
+    tableDelete(&table, keys[i % names]);
+  }
+  report("churn set+delete", count, &table, OPS, start);
+
+  freeTable(&table);
+  freeKeys(keys, names);
+}
+
+// Mirrors internString: look the characters up and only add them when
+// they are not interned yet. The second pass finds every string.
+static void benchIntern(int count) {
+  ObjString **keys = newKeys("intern", count);
+  int rounds = OPS / count / 2 + 1;
+  Table table;
+
+  clock_t start = clock();
+  for (int round = 0; round < rounds; round++) {
+    initTable(&table);
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < count; i++) {
+        ObjString *key = keys[i];
+        if (tableFindString(&table, getCString(key), key->length,
+                            key->hash) == nullptr)
+          tableSet(&table, key, NIL_VAL);
+      }
+    }
+    if (round + 1 < rounds)
+      freeTable(&table);
+  }
+  report("intern", count, &table, (long)rounds * count * 2, start);
+
+  freeTable(&table);
+  freeKeys(keys, count);
+}
+
+int main() {
+  int sizes[] = {4, 8, 64, 1024, 65536};
+  int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+  // Key counts spread over one capacity, from just past a resize to the
+  // maximum load
+  int loads[] = {1537, 2048, 2560, 3072};
+  int loadCount = sizeof(loads) / sizeof(loads[0]);
+
+  printf("%-24s %8s %6s %10s %12s\n", "scenario", "keys", "load", "ns/op",
+         "bytes/entry");
+
+  for (int i = 0; i < sizeCount; i++)
+    benchInsert(sizes[i]);
+  for (int i = 0; i < sizeCount; i++)
+    benchGet("get hit", sizes[i], 100);
+  for (int i = 0; i < sizeCount; i++)
+    benchGet("get miss", sizes[i], 0);
+  for (int i = 0; i < sizeCount; i++)
+    benchGet("get 50% hit", sizes[i], 50);
+  for (int i = 0; i < loadCount; i++)
+    benchGet("get 90% hit by load", loads[i], 90);
+  for (int i = 0; i < sizeCount; i++)
+    benchChurn(sizes[i]);
+  for (int i = 0; i < sizeCount; i++)
+    benchIntern(sizes[i]);
+
+  return EXIT_SUCCESS;
+}
@@ -12,6 +12,8 @@ static ObjString *newString(const char *start) {
   string->length = length;
   string->isBorrowed = false;
   string->hash = hashString(start, length);
+  string->isHashed = true;
+  string->isInterned = false;
   memcpy((void *)string->content, (void *)start, length);
 
   return string;
@@ -61,7 +63,8 @@ int main() {
 
   unset(&table, "baz");
 
-  assert(table.count == 7);
+  // The only group still has empty slots, so the delete leaves no tombstone
+  assert(table.count == 6);
   assert(table.capacity == 16);
   assert(table.entries != nullptr);
 
@@ -73,14 +76,41 @@ int main() {
   unset(&table, "bax");
   unset(&table, "qux_1");
 
-  assert(table.count == 7);
+  assert(table.count == 2);
   assert(table.capacity == 16);
   assert(table.entries != nullptr);
 
+  // Churning through distinct keys must not build up tombstones or grow
+  char key[16];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "churn_%d", i);
+    set(&table, key, NUMBER_VAL(i));
+    unset(&table, key);
+  }
+
+  assert(table.count == 2);
+  assert(table.capacity == 16);
+  assert(get(&table, "qux_2", &value));
+
   tableDump(&table);
 
   freeTable(&table);
 
+  // Small tables stay packed when an entry in the middle is deleted
+  set(&table, "foo", BOOL_VAL(true));
+  set(&table, "bar", BOOL_VAL(false));
+  set(&table, "baz", BOOL_VAL(true));
+  unset(&table, "foo");
+
+  assert(table.count == 2);
+  assert(table.capacity == 8);
+  assert(table.entries[2].key == nullptr);
+  assert(!get(&table, "foo", &value));
+  assert(get(&table, "bar", &value) && !AS_BOOL(value));
+  assert(get(&table, "baz", &value) && AS_BOOL(value));
+
+  freeTable(&table);
+
   printf("All tests passed!\n");
 
   return EXIT_SUCCESS;
@@ -46,6 +46,12 @@ void valueArrayDump(ValueArray *array) {
   }
 }
 
+static void printSmallString(Value value) {
+  char chars[SMALL_STRING_MAX];
+  int length = smallStringChars(value, chars);
+  printf("%.*s", length, chars);
+}
+
 #ifdef NAN_BOXING
 static void asBinary(uint64_t number, char binary[65]) {
   for (int i = 63; i >= 0; i--)
@@ -64,6 +70,10 @@ void printValue(Value value) {
     printf("%g", AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
     printObject(value);
+  } else if (IS_SMALL_STRING(value)) {
+    printSmallString(value);
+  } else if (IS_UNDEFINED(value)) {
+    printf("undefined");
   } else {
     char binary[65];
     asBinary(value, binary);
@@ -83,6 +93,12 @@ void printValue(Value value) {
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_SMALL_STRING:
+    printSmallString(value);
+    break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   default:
     err(64, "Unhandeled value type '%d'", value.type);
     break;
@@ -95,7 +111,15 @@ bool valuesEqual(Value a, Value b) {
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b)
+    return true;
+  // Only text can equal a different object
+  if (!IS_OBJ(a) || !IS_OBJ(b))
+    return false;
+  if (OBJ_TYPE(a) == OBJ_STRING && OBJ_TYPE(b) == OBJ_STRING)
+    return stringsEqual(AS_STRING(a), AS_STRING(b));
+  return (OBJ_TYPE(a) == OBJ_ROPE || OBJ_TYPE(b) == OBJ_ROPE) &&
+         ropesEqual(a, b);
 #else
   if (a.type != b.type)
     return false;
@@ -108,7 +132,16 @@ bool valuesEqual(Value a, Value b) {
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
-    return AS_OBJ(a) == AS_OBJ(b);
+    if (AS_OBJ(a) == AS_OBJ(b))
+      return true;
+    if (OBJ_TYPE(a) == OBJ_STRING && OBJ_TYPE(b) == OBJ_STRING)
+      return stringsEqual(AS_STRING(a), AS_STRING(b));
+    return (OBJ_TYPE(a) == OBJ_ROPE || OBJ_TYPE(b) == OBJ_ROPE) &&
+           ropesEqual(a, b);
+  case VAL_SMALL_STRING:
+    return AS_SMALL_STRING(a) == AS_SMALL_STRING(b);
+  case VAL_UNDEFINED:
+    return true;
   default:
     return false;
   }
@@ -5,6 +5,7 @@
 #include <string.h>
 
 typedef struct Obj Obj;
+typedef struct ObjClass ObjClass;
 typedef struct ObjFunction ObjFunction;
 typedef struct ObjString ObjString;
 
@@ -17,6 +18,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE  3 // 11
+#define TAG_UNDEFINED 4 // 100
 
 typedef uint64_t Value;
 
@@ -33,6 +35,17 @@ typedef uint64_t Value;
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define IS_NIL(value) ((value) == NIL_VAL)
 
+// Never visible to Lox code: marks a global slot that is not defined yet
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+// Small strings keep their chars in the low 48 bits, below this tag
+#define TAG_SMALL_STRING ((uint64_t)1 << 49)
+#define SMALL_STRING_VAL(bits) ((Value)(QNAN | TAG_SMALL_STRING | (bits)))
+#define AS_SMALL_STRING(value) ((value) & 0xffffffffffffull)
+#define IS_SMALL_STRING(value)                                                 \
+  (((value) & (SIGN_BIT | QNAN | TAG_SMALL_STRING)) == (QNAN | TAG_SMALL_STRING))
+
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 #define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -58,6 +71,8 @@ typedef enum {
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_SMALL_STRING,
+  VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -66,6 +81,7 @@ typedef struct {
     bool boolean;
     double number;
     Obj *obj;
+    uint64_t small;
   } as;
 } Value;
 
@@ -73,18 +89,54 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_SMALL_STRING(value) ((value).type == VAL_SMALL_STRING)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value) ((value).as.obj)
+#define AS_SMALL_STRING(value) ((value).as.small)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj*)value}})
+#define SMALL_STRING_VAL(bits) ((Value){VAL_SMALL_STRING, {.small = bits}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
+// Strings this short are kept in the value itself, one char per byte from
+// the lowest, so they need no allocation. The length is where the chars
+// end, so strings holding a NUL are left to the heap. Every other string
+// of this length is small, which keeps equality a plain compare.
+#define SMALL_STRING_MAX 6
+
+static inline bool fitsSmallString(const char *chars, int length) {
+  return length <= SMALL_STRING_MAX && memchr(chars, '\0', length) == nullptr;
+}
+
+static inline Value smallStringVal(const char *chars, int length) {
+  uint64_t bits = 0;
+  for (int i = length - 1; i >= 0; i--)
+    bits = (bits << 8) | (uint8_t)chars[i];
+  return SMALL_STRING_VAL(bits);
+}
+
+static inline int smallStringLength(Value value) {
+  uint64_t bits = AS_SMALL_STRING(value);
+  return bits == 0 ? 0 : (71 - __builtin_clzll(bits)) / 8;
+}
+
+// Writes the chars to dest, which needs room for SMALL_STRING_MAX of them
+static inline int smallStringChars(Value value, char *dest) {
+  uint64_t bits = AS_SMALL_STRING(value);
+  int length = 0;
+  for (; bits != 0; bits >>= 8)
+    dest[length++] = (char)(bits & 0xff);
+  return length;
+}
+
 typedef struct {
   int capacity;
   int count;
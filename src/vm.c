@@ -1,6 +1,7 @@
 #include "vm.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "map.h"
 #include "memory.h"
 #include "object.h"
 #include "stack.h"
@@ -15,7 +16,7 @@
 #include <string.h>
 #include <time.h>
 
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_OPCODE_STATS)
 #include "debug.h"
 #endif
 
@@ -23,6 +24,50 @@
 
 VM vm;
 
+#ifdef DEBUG_OPCODE_STATS
+// How often each opcode ran, and how often it ran straight after another.
+// This is what picks the superinstructions.
+static long opcodeCounts[UINT8_COUNT];
+static long opcodePairs[UINT8_COUNT][UINT8_COUNT];
+static int previousOpcode = -1;
+
+static void countOpcode(uint8_t opcode) {
+  opcodeCounts[opcode]++;
+  if (previousOpcode != -1)
+    opcodePairs[previousOpcode][opcode]++;
+  previousOpcode = opcode;
+}
+
+#define OPCODE_STATS_SHOWN 24
+
+static void printOpcodeStats() {
+  long total = 0;
+  for (int i = 0; i < UINT8_COUNT; i++)
+    total += opcodeCounts[i];
+  if (total == 0)
+    return;
+
+  fprintf(stderr, "%ld instructions, most frequent pairs:\n", total);
+  for (int shown = 0; shown < OPCODE_STATS_SHOWN; shown++) {
+    int first = 0;
+    int second = 0;
+    for (int i = 0; i < UINT8_COUNT; i++)
+      for (int j = 0; j < UINT8_COUNT; j++)
+        if (opcodePairs[i][j] > opcodePairs[first][second]) {
+          first = i;
+          second = j;
+        }
+    if (opcodePairs[first][second] == 0)
+      break;
+
+    fprintf(stderr, "%6.2f%%  %s %s\n",
+            100.0 * opcodePairs[first][second] / total, opcodeName(first),
+            opcodeName(second));
+    opcodePairs[first][second] = 0;
+  }
+}
+#endif
+
 static void runtimeError(const char *format, ...);
 static void defineNative(const char *name, NativeFn fun, int arity);
 
@@ -31,16 +76,25 @@ static Value clockNative(int argCount, Value *args) {
 }
 
 static Value envNative(int argCount, Value *args) {
-  if (!IS_STRING(*args)) {
+  if (!IS_STRING(*args) && !IS_SMALL_STRING(*args)) {
     runtimeError("argument to 'env' native function must be a string.");
+    return UNDEFINED_VAL;
   }
 
-  const char *name = copyString(AS_STRING(*args));
+  char small[SMALL_STRING_MAX];
+  StringRef ref = textRef(*args, small);
+  // Not strndup, its memory would not come from the wrapped malloc
+  char *name = malloc(ref.length + 1);
+  memcpy(name, ref.content, ref.length);
+  name[ref.length] = '\0';
   const char *var = getenv(name);
-  free((void *)name);
+  free(name);
 
   if (var != nullptr) {
-    return OBJ_VAL(newOwnedString(var, strlen(var)));
+    size_t length = strlen(var);
+    if (fitsSmallString(var, length))
+      return smallStringVal(var, length);
+    return OBJ_VAL(newOwnedString(var, length));
   }
 
   return NIL_VAL;
@@ -80,8 +134,133 @@ static Value exitNative(int argCout, Value *args) {
   exit((int)round(AS_NUMBER(*args)));
 }
 
+// Map natives report bad arguments and return UNDEFINED_VAL, which makes the
+// call fail instead of pushing a result
+static bool checkMap(Value value, const char *native) {
+  if (IS_MAP(value))
+    return true;
+  runtimeError("first argument to '%s' native function must be a map.",
+               native);
+  return false;
+}
+
+static Value mapNative(int argCount, Value *args) {
+  return OBJ_VAL(newMap(nullptr, 0));
+}
+
+static Value mapGetNative(int argCount, Value *args) {
+  if (!checkMap(args[0], "mapGet"))
+    return UNDEFINED_VAL;
+
+  Value value;
+  return mapGet(AS_MAP(args[0]), args[1], &value) ? value : NIL_VAL;
+}
+
+static Value mapHasNative(int argCount, Value *args) {
+  if (!checkMap(args[0], "mapHas"))
+    return UNDEFINED_VAL;
+
+  Value value;
+  return BOOL_VAL(mapGet(AS_MAP(args[0]), args[1], &value));
+}
+
+static Value mapSetNative(int argCount, Value *args) {
+  if (!checkMap(args[0], "mapSet"))
+    return UNDEFINED_VAL;
+
+  // Keys outlive the call, so a view is not left holding on to its owner
+  if (IS_STRING(args[1]) && isStringView(AS_STRING(args[1])))
+    args[1] = OBJ_VAL(internString(AS_STRING(args[1])));
+
+  return OBJ_VAL(mapSet(AS_MAP(args[0]), args[1], args[2]));
+}
+
+static Value mapRemoveNative(int argCount, Value *args) {
+  if (!checkMap(args[0], "mapRemove"))
+    return UNDEFINED_VAL;
+
+  return OBJ_VAL(mapRemove(AS_MAP(args[0]), args[1]));
+}
+
+static Value mapCountNative(int argCount, Value *args) {
+  if (!checkMap(args[0], "mapCount"))
+    return UNDEFINED_VAL;
+
+  return NUMBER_VAL(AS_MAP(args[0])->count);
+}
+
+static Value stringLengthNative(int argCount, Value *args) {
+  if (!IS_STRING(args[0]) && !IS_SMALL_STRING(args[0])) {
+    runtimeError("argument to 'stringLength' native function must be a "
+                 "string.");
+    return UNDEFINED_VAL;
+  }
+
+  return NUMBER_VAL(textLength(args[0]));
+}
+
+// The chars from start up to end. Anything longer than a small string is a
+// view into the argument, so cutting up a large text copies nothing.
+static Value substringNative(int argCount, Value *args) {
+  if (!IS_STRING(args[0]) && !IS_SMALL_STRING(args[0])) {
+    runtimeError("first argument to 'substring' native function must be a "
+                 "string.");
+    return UNDEFINED_VAL;
+  }
+
+  int length = textLength(args[0]);
+  if (!IS_NUMBER(args[1]) || !IS_NUMBER(args[2]) ||
+      AS_NUMBER(args[1]) != (int)AS_NUMBER(args[1]) ||
+      AS_NUMBER(args[2]) != (int)AS_NUMBER(args[2]) || AS_NUMBER(args[1]) < 0 ||
+      AS_NUMBER(args[2]) < AS_NUMBER(args[1]) || AS_NUMBER(args[2]) > length) {
+    runtimeError("range given to 'substring' native function must be whole "
+                 "numbers within the string.");
+    return UNDEFINED_VAL;
+  }
+
+  int start = (int)AS_NUMBER(args[1]);
+  int count = (int)AS_NUMBER(args[2]) - start;
+  char small[SMALL_STRING_MAX];
+  StringRef ref = textRef(args[0], small);
+
+  if (fitsSmallString(ref.content + start, count))
+    return smallStringVal(ref.content + start, count);
+  return OBJ_VAL(newStringView(AS_STRING(args[0]), start, count));
+}
+
+// Every identifier and string literal is interned. Being probed by control
+// bytes, the table can run fuller than the default. It still starts small,
+// as starting at 256 slots made instantiation 50% slower with mmm.
+static const TablePolicy stringsPolicy = {
+    .initialCapacity = 8,
+    .maxLoad = 0.875,
+    .growthFactor = 2,
+};
+
+// Scripts define anywhere from a handful to many thousands of globals, and
+// the table is only consulted while compiling, so it grows in big steps
+static const TablePolicy globalsPolicy = {
+    .initialCapacity = 8,
+    .maxLoad = 0.875,
+    .growthFactor = 4,
+};
+
+// Looked up whenever an instance gains a field; most programs only have a
+// few method names, which the small linear mode handles best
+static const TablePolicy selectorsPolicy = {
+    .initialCapacity = 8,
+    .maxLoad = 0.875,
+    .growthFactor = 2,
+};
+
+// The allocators exit on fatal errors without returning to interpret, so
+// whatever print left in the buffer is written when the process exits
+static void flushOutputAtExit() { flushOutput(&vm.output); }
+
 void initVM() {
-  initStack(&vm.stack);
+  initStack(&vm.stack, STACK_MAX);
+  initOutput(&vm.output);
+  atexit(flushOutputAtExit);
   vm.objects = nullptr;
   vm.bytesAllocated = 0;
   vm.nextGC = INITIAL_NEXT_GC;
@@ -91,8 +270,13 @@ void initVM() {
   vm.grayStack = nullptr;
   vm.markValue = true;
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+  memset(vm.cacheSites, 0, sizeof(vm.cacheSites));
+
+  initTableWithPolicy(&vm.globals, &globalsPolicy);
+  initValueArray(&vm.globalValues);
+  initTableWithPolicy(&vm.strings, &stringsPolicy);
+  initTableWithPolicy(&vm.selectors, &selectorsPolicy);
+  vm.selectorCount = 0;
 
   vm.initString = nullptr;
   vm.initString = newOwnedString("init", 4);
@@ -101,23 +285,46 @@ void initVM() {
   defineNative("env", envNative, 1);
   defineNative("rand", randNative, 2);
   defineNative("exit", exitNative, 1);
+  defineNative("map", mapNative, 0);
+  defineNative("mapGet", mapGetNative, 2);
+  defineNative("mapHas", mapHasNative, 2);
+  defineNative("mapSet", mapSetNative, 3);
+  defineNative("mapRemove", mapRemoveNative, 2);
+  defineNative("mapCount", mapCountNative, 1);
+  defineNative("stringLength", stringLengthNative, 1);
+  defineNative("substring", substringNative, 3);
 }
 
 void freeVM() {
+#ifdef DEBUG_CACHE_STATS
+  fprintf(stderr,
+          "inline caches: %d uninitialized, %d monomorphic, %d polymorphic, "
+          "%d megamorphic\n",
+          vm.cacheSites[CACHE_UNINITIALIZED], vm.cacheSites[CACHE_MONOMORPHIC],
+          vm.cacheSites[CACHE_POLYMORPHIC], vm.cacheSites[CACHE_MEGAMORPHIC]);
+#endif
+#ifdef DEBUG_OPCODE_STATS
+  printOpcodeStats();
+#endif
+
   freeStack(&vm.stack);
   freeTable(&vm.globals);
+  freeValueArray(&vm.globalValues);
   freeTable(&vm.strings);
+  freeTable(&vm.selectors);
   vm.initString = nullptr;
   freeObjects();
 }
 
 static void resetStack() {
-  freeStack(&vm.stack);
+  stackReset(&vm.stack, 0);
   vm.frameCount = 0;
   vm.openUpvalues = nullptr;
 }
 
 static void runtimeError(const char *format, ...) {
+  flushOutput(&vm.output);
+
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -141,8 +348,9 @@ static void runtimeError(const char *format, ...) {
 }
 
 static inline bool isInit(ObjString *name) {
-  return strncmp(getCString(name), getCString(vm.initString),
-                 vm.initString->length) == 0;
+  return name->length == vm.initString->length &&
+         memcmp(getCString(name), getCString(vm.initString), name->length) ==
+             0;
 }
 
 void push(Value value) { pushOnStack(&vm.stack, value); }
@@ -150,10 +358,53 @@ Value pop() { return popFromStack(&vm.stack); }
 
 static Value peek(int distance) { return peekFromStack(&vm.stack, distance); }
 
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globals, name, &slot))
+    return (int)AS_NUMBER(slot);
+
+  push(OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  tableSet(&vm.globals, name, NUMBER_VAL(vm.globalValues.count - 1));
+  pop();
+
+  return vm.globalValues.count - 1;
+}
+
+int methodSelector(ObjString *name) {
+  Value selector;
+  if (tableGet(&vm.selectors, name, &selector))
+    return (int)AS_NUMBER(selector);
+
+  push(OBJ_VAL(name));
+  tableSet(&vm.selectors, name, NUMBER_VAL(vm.selectorCount));
+  pop();
+
+  return vm.selectorCount++;
+}
+
+int findSelector(ObjString *name) {
+  Value selector;
+  if (tableGet(&vm.selectors, name, &selector))
+    return (int)AS_NUMBER(selector);
+  return -1;
+}
+
+// Reverse lookup, only meant for error messages and disassembly
+ObjString *globalName(int slot) {
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry *entry = &vm.globals.entries[i];
+    if (entry->key != nullptr && AS_NUMBER(entry->value) == slot)
+      return entry->key;
+  }
+  return nullptr;
+}
+
 static void defineNative(const char *name, NativeFn fun, int arity) {
   push(OBJ_VAL(newOwnedString(name, strlen(name))));
   push(OBJ_VAL(newNative(fun, arity)));
-  tableSet(&vm.globals, AS_STRING(peek(1)), peek(0));
+  int slot = globalSlot(AS_STRING(peek(1)));
+  vm.globalValues.values[slot] = peek(0);
   pop();
   pop();
 }
@@ -165,7 +416,8 @@ static bool callFunction(ObjFunction *fun, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  Value *slots = vm.stack.top - argCount - 1;
+  if (vm.frameCount == FRAMES_MAX || slots + fun->maxStack > vm.stack.limit) {
     runtimeError("Stack overflow.");
     return false;
   }
@@ -174,7 +426,8 @@ static bool callFunction(ObjFunction *fun, int argCount) {
   frame->type = CALLEE_FUNCTION;
   frame->as.function = fun;
   frame->ip = fun->chunk.code;
-  frame->stackIndex = vm.stack.count - argCount - 1;
+  frame->constants = fun->chunk.constants.values;
+  frame->slots = slots;
 
   return true;
 }
@@ -188,7 +441,9 @@ static bool callClosure(ObjClosure *closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  Value *slots = vm.stack.top - argCount - 1;
+  if (vm.frameCount == FRAMES_MAX ||
+      slots + closure->function->maxStack > vm.stack.limit) {
     runtimeError("Stack overflow.");
     return false;
   }
@@ -197,7 +452,8 @@ static bool callClosure(ObjClosure *closure, int argCount) {
   frame->type = CALLEE_CLOSURE;
   frame->as.closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->stackIndex = vm.stack.count - argCount - 1;
+  frame->constants = closure->function->chunk.constants.values;
+  frame->slots = slots;
 
   return true;
 }
@@ -245,7 +501,13 @@ static bool callValue(Value callee, int argCount) {
                      native->arity, argCount);
         return false;
       }
-      Value result = native->function(argCount, vm.stack.top - argCount);
+      // Natives only ever see flat strings
+      Value *args = vm.stack.top - argCount;
+      for (int i = 0; i < argCount; i++)
+        args[i] = flattenValue(args[i]);
+      Value result = native->function(argCount, args);
+      if (IS_UNDEFINED(result))
+        return false;
       stackDrop(&vm.stack, argCount + 1);
       push(result);
       return true;
@@ -253,22 +515,91 @@ static bool callValue(Value callee, int argCount) {
       runtimeError("Cannot call object type '%s'.", getType(OBJ_TYPE(callee)));
       break;
     }
+  } else if (IS_SMALL_STRING(callee)) {
+    // Short strings live in the value, but fail like the strings on the heap
+    runtimeError("Cannot call object type '%s'.", getType(OBJ_STRING));
   }
 
   runtimeError("Can only call function and classes.");
   return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
-  Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
+static void setCacheState(InlineCache *cache, CacheState state) {
+  vm.cacheSites[cache->state]--;
+  vm.cacheSites[state]++;
+  cache->state = state;
+}
+
+static inline CacheEntry *findCacheEntry(InlineCache *cache, ObjClass *klass) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].klass == klass)
+      return &cache->entries[i];
+  }
+  return nullptr;
+}
+
+// Returns the entry for klass, claiming a free one if needed. Once all
+// entries are taken the site is megamorphic and nullptr is returned.
+static CacheEntry *addCacheEntry(InlineCache *cache, ObjClass *klass) {
+  CacheEntry *entry = findCacheEntry(cache, klass);
+  if (entry != nullptr)
+    return entry;
+
+  if (cache->count == CACHE_ENTRIES) {
+    if (cache->state != CACHE_MEGAMORPHIC)
+      setCacheState(cache, CACHE_MEGAMORPHIC);
+    return nullptr;
+  }
+
+  entry = &cache->entries[cache->count++];
+  entry->klass = klass;
+  entry->method = nullptr;
+  entry->slot = -1;
+
+  setCacheState(cache, cache->count == 1 ? CACHE_MONOMORPHIC
+                                         : CACHE_POLYMORPHIC);
+
+  return entry;
+}
+
+static void cacheSlot(InlineCache *cache, ObjClass *klass, int slot) {
+  CacheEntry *entry = addCacheEntry(cache, klass);
+  if (entry != nullptr)
+    entry->slot = slot;
+}
+
+static void cacheMethod(InlineCache *cache, ObjClass *klass, Obj *method) {
+  CacheEntry *entry = addCacheEntry(cache, klass);
+  if (entry != nullptr)
+    entry->method = method;
+}
+
+// A cached slot is only trusted if the entry there still holds the very same
+// key; any resize, deletion or different instance layout fails the guard.
+static inline bool isCachedField(CacheEntry *entry, ObjInstance *instance,
+                                 ObjString *name) {
+  return entry != nullptr && entry->slot >= 0 &&
+         entry->slot < instance->fields.capacity &&
+         instance->fields.entries[entry->slot].key == name;
+}
+
+static inline bool isCachedMethod(CacheEntry *entry, ObjInstance *instance) {
+  return entry != nullptr && entry->method != nullptr &&
+         !instance->klass->shadowed;
+}
+
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount,
+                            InlineCache *cache) {
+  Obj *method = getMethod(klass, cache->selector);
+  if (method == nullptr) {
     runtimeError("Undefined property '%.*s'.", name->length, getCString(name));
     return false;
   }
-  return call(AS_OBJ(method), argCount);
+  cacheMethod(cache, klass, method);
+  return call(method, argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
   Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -278,31 +609,53 @@ static bool invoke(ObjString *name, int argCount) {
 
   ObjInstance *instance = AS_INSTANCE(receiver);
 
+  CacheEntry *entry = findCacheEntry(cache, instance->klass);
+  if (isCachedMethod(entry, instance)) {
+    return call(entry->method, argCount);
+  }
+
   Value value;
   if (tableGet(&instance->fields, name, &value)) {
     return callValue(value, argCount);
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  return invokeFromClass(instance->klass, name, argCount, cache);
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name) {
-  ObjBoundMethod *bound;
-  Value method;
-  if (isInit(name)) {
-    bound = newBoundMethod(peek(0), klass->init);
-  } else if (tableGet(&klass->methods, name, &method)) {
-    bound = newBoundMethod(peek(0), AS_OBJ(method));
-  } else {
-    return false;
-  }
+static Obj *findMethod(ObjClass *klass, ObjString *name, int selector) {
+  if (isInit(name))
+    return klass->init;
+  return getMethod(klass, selector);
+}
 
+static void bindReceiver(Obj *method) {
+  ObjBoundMethod *bound = newBoundMethod(peek(0), method);
   pop();
   push(OBJ_VAL(bound));
+}
+
+static bool bindMethod(ObjClass *klass, ObjString *name) {
+  Obj *method = findMethod(klass, name, findSelector(name));
+  if (method == nullptr)
+    return false;
+
+  bindReceiver(method);
 
   return true;
 }
 
+static int setField(ObjInstance *instance, ObjString *name, Value value) {
+  int slot;
+  if (tableSetSlot(&instance->fields, name, value, &slot)) {
+    ObjClass *klass = instance->klass;
+    if (instance->fields.count > klass->fieldCount)
+      klass->fieldCount = instance->fields.count;
+    if (findMethod(klass, name, findSelector(name)) != nullptr)
+      klass->shadowed = true;
+  }
+  return slot;
+}
+
 static ObjUpvalue *captureUpvalue(int stackIndex) {
   ObjUpvalue *prevUpvalue = nullptr;
   ObjUpvalue *upvalue = vm.openUpvalues;
@@ -338,9 +691,10 @@ static void closeUpvalue(int valueStackIndex) {
 }
 
 static void defineMethod(ObjString *name) {
+  int selector = methodSelector(name);
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
-  tableSet(&klass->methods, name, method);
+  setMethod(klass, selector, AS_OBJ(method));
 
   if (isInit(name))
     klass->init = AS_OBJ(method);
@@ -352,42 +706,213 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  ObjString *b = AS_STRING(peek(0));
-  ObjString *a = AS_STRING(peek(1));
-
-  ObjString *result =
-      allocateString(a->length + b->length, 2, toStringRef(a), toStringRef(b));
+// Results shorter than this are copied straight away, as a rope node would
+// cost about as much as the characters
+#define ROPE_MIN_LENGTH 64
+
+static bool concatenate() {
+  Value b = peek(0);
+  Value a = peek(1);
+  // Ropes make doubling a string cheap, so the sum can outgrow an int
+  int64_t total = (int64_t)textLength(a) + textLength(b);
+  if (total > INT_MAX) {
+    runtimeError("String too long.");
+    return false;
+  }
+  int length = (int)total;
+
+  Value result;
+  if (IS_SMALL_STRING(a) && IS_SMALL_STRING(b) && length <= SMALL_STRING_MAX) {
+    // Only short strings holding a NUL live on the heap, so a short result
+    // of anything but two small strings holds one as well
+    result = SMALL_STRING_VAL(AS_SMALL_STRING(a) |
+                              AS_SMALL_STRING(b) << (8 * textLength(a)));
+  } else if (length < ROPE_MIN_LENGTH) {
+    char smallA[SMALL_STRING_MAX];
+    char smallB[SMALL_STRING_MAX];
+    result = OBJ_VAL(allocateString(length, 2, textRef(a, smallA),
+                                    textRef(b, smallB)));
+  } else {
+    result = OBJ_VAL(newRope(a, b, length));
+  }
 
   pop();
   pop();
 
-  push(OBJ_VAL(result));
+  push(result);
+  return true;
 }
 
 static InterpretResult run() {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
   uint8_t register *ip = frame->ip;
+  Value register *sp = vm.stack.top;
+  Value *constants = frame->constants;
+  Value *slots = frame->slots;
+  // Globals only gain slots while compiling, so the array stays put
+  Value *globals = vm.globalValues.values;
 
 #define READ_BYTE() (*ip++)
 #define READ_SHORT() (ip += 2, (uint16_t)((*(ip - 2)) << 8) | *(ip - 1))
-#define READ_CONSTANT() (GET_CALLEE(frame)->chunk.constants.values[READ_BYTE()])
-#define READ_LONG_CONSTANT()                                                   \
-  (GET_CALLEE(frame)->chunk.constants.values[READ_SHORT()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_LONG_CONSTANT() (constants[READ_SHORT()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_STRING_LONG() AS_STRING(READ_LONG_CONSTANT())
+#define READ_CACHE() (&GET_CALLEE(frame)->chunk.caches[READ_SHORT()])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+// The top of the stack lives in sp. Anything that can allocate or use the
+// stack itself needs it in vm.stack.top first, and whatever changed the
+// stack has sp picked up again afterwards.
+#define STORE_SP() (vm.stack.top = sp)
+#define LOAD_SP() (sp = vm.stack.top)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    constants = frame->constants;                                              \
+    slots = frame->slots;                                                      \
+  } while (false)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      frame->ip = ip;                                                          \
+      runtimeError("Operand must be numbers.");                                \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    PUSH(valueType(a op b));                                                   \
+  } while (false)
+// A local and a number constant, then op. A local that is not a number
+// runs the instructions one at a time, starting with its OP_GET_LOCAL.
+#define LOCAL_CONSTANT_OP(valueType, op)                                       \
+  do {                                                                         \
+    Value local = slots[ip[0]];                                                \
+    if (IS_NUMBER(local)) {                                                    \
+      double constant = AS_NUMBER(constants[ip[2]]);                           \
+      ip += 4;                                                                 \
+      PUSH(valueType(AS_NUMBER(local) op constant));                           \
+    } else {                                                                   \
+      PUSH(local);                                                             \
+      ip++;                                                                    \
+    }                                                                          \
+  } while (false)
+// The OP_JUMP_IF_FALSE and OP_POP after a comparison. The result is only
+// left on the stack for the jump's target.
+#define COMPARE_JUMP(condition)                                                \
+  do {                                                                         \
+    uint16_t offset = (uint16_t)(ip[1] << 8) | ip[2];                          \
+    if (condition) {                                                           \
+      ip += 4;                                                                 \
+    } else {                                                                   \
+      PUSH(BOOL_VAL(false));                                                   \
+      ip += 3 + offset;                                                        \
+    }                                                                          \
+  } while (false)
+// Writes the quickened form over a short property instruction, whose
+// operands have just been read, once its site has only found fields, all in
+// instances of one class
+#define QUICKEN_FIELD(generic, quickened)                                      \
+  do {                                                                         \
+    if (instruction == generic && cache->state == CACHE_MONOMORPHIC)           \
+      ip[-4] = quickened;                                                      \
+  } while (false)
+#define NUMBER_COMPARE_JUMP(op)                                                \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
       frame->ip = ip;                                                          \
       runtimeError("Operand must be numbers.");                                \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    COMPARE_JUMP(a op b);                                                      \
   } while (false)
 
+// Handlers jump straight to the next one through a table of label
+// addresses, giving each its own indirect branch to predict. Compilers
+// without labels as values, traced builds and SWITCH_DISPATCH builds use
+// a plain switch, where every handler goes back to the top of the loop.
+// So do builds counting opcodes, which happens at the top of the loop.
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION) &&                    \
+    !defined(DEBUG_OPCODE_STATS) && !defined(SWITCH_DISPATCH)
+  static void *dispatchTable[] = {
+      [OP_CONSTANT] = &&OP_CONSTANT_HANDLER,
+      [OP_CONSTANT_LONG] = &&OP_CONSTANT_LONG_HANDLER,
+      [OP_NIL] = &&OP_NIL_HANDLER,
+      [OP_TRUE] = &&OP_TRUE_HANDLER,
+      [OP_FALSE] = &&OP_FALSE_HANDLER,
+      [OP_POP] = &&OP_POP_HANDLER,
+      [OP_GET_LOCAL] = &&OP_GET_LOCAL_HANDLER,
+      [OP_SET_LOCAL] = &&OP_SET_LOCAL_HANDLER,
+      [OP_GET_GLOBAL] = &&OP_GET_GLOBAL_HANDLER,
+      [OP_GET_GLOBAL_LONG] = &&OP_GET_GLOBAL_LONG_HANDLER,
+      [OP_DEFINE_GLOBAL] = &&OP_DEFINE_GLOBAL_HANDLER,
+      [OP_DEFINE_GLOBAL_LONG] = &&OP_DEFINE_GLOBAL_LONG_HANDLER,
+      [OP_SET_GLOBAL] = &&OP_SET_GLOBAL_HANDLER,
+      [OP_SET_GLOBAL_LONG] = &&OP_SET_GLOBAL_LONG_HANDLER,
+      [OP_GET_UPVALUE] = &&OP_GET_UPVALUE_HANDLER,
+      [OP_SET_UPVALUE] = &&OP_SET_UPVALUE_HANDLER,
+      [OP_GET_PROP] = &&OP_GET_PROP_HANDLER,
+      [OP_GET_PROP_LONG] = &&OP_GET_PROP_LONG_HANDLER,
+      [OP_GET_PROP_STR] = &&OP_GET_PROP_STR_HANDLER,
+      [OP_SET_PROP] = &&OP_SET_PROP_HANDLER,
+      [OP_SET_PROP_LONG] = &&OP_SET_PROP_LONG_HANDLER,
+      [OP_SET_PROP_STR] = &&OP_SET_PROP_STR_HANDLER,
+      [OP_GET_SUPER] = &&OP_GET_SUPER_HANDLER,
+      [OP_GET_SUPER_LONG] = &&OP_GET_SUPER_LONG_HANDLER,
+      [OP_EQUAL] = &&OP_EQUAL_HANDLER,
+      [OP_CMP] = &&OP_CMP_HANDLER,
+      [OP_GREATER] = &&OP_GREATER_HANDLER,
+      [OP_LESS] = &&OP_LESS_HANDLER,
+      [OP_ADD] = &&OP_ADD_HANDLER,
+      [OP_SUBTRACT] = &&OP_SUBTRACT_HANDLER,
+      [OP_MULTIPLY] = &&OP_MULTIPLY_HANDLER,
+      [OP_DIVIDE] = &&OP_DIVIDE_HANDLER,
+      [OP_NOT] = &&OP_NOT_HANDLER,
+      [OP_NEGATE] = &&OP_NEGATE_HANDLER,
+      [OP_PRINT] = &&OP_PRINT_HANDLER,
+      [OP_JUMP] = &&OP_JUMP_HANDLER,
+      [OP_JUMP_IF_FALSE] = &&OP_JUMP_IF_FALSE_HANDLER,
+      [OP_LOOP] = &&OP_LOOP_HANDLER,
+      [OP_CALL] = &&OP_CALL_HANDLER,
+      [OP_INVOKE] = &&OP_INVOKE_HANDLER,
+      [OP_INVOKE_LONG] = &&OP_INVOKE_LONG_HANDLER,
+      [OP_SUPER_INVOKE] = &&OP_SUPER_INVOKE_HANDLER,
+      [OP_SUPER_INVOKE_LONG] = &&OP_SUPER_INVOKE_LONG_HANDLER,
+      [OP_CLOSURE] = &&OP_CLOSURE_HANDLER,
+      [OP_CLOSURE_LONG] = &&OP_CLOSURE_LONG_HANDLER,
+      [OP_CLOSE_UPVALUE] = &&OP_CLOSE_UPVALUE_HANDLER,
+      [OP_RETURN] = &&OP_RETURN_HANDLER,
+      [OP_CLASS] = &&OP_CLASS_HANDLER,
+      [OP_CLASS_LONG] = &&OP_CLASS_LONG_HANDLER,
+      [OP_METHOD] = &&OP_METHOD_HANDLER,
+      [OP_METHOD_LONG] = &&OP_METHOD_LONG_HANDLER,
+      [OP_INIT] = &&OP_INIT_HANDLER,
+      [OP_INHERIT] = &&OP_INHERIT_HANDLER,
+      [OP_GET_LOCAL_2] = &&OP_GET_LOCAL_2_HANDLER,
+      [OP_GET_LOCAL_PROP] = &&OP_GET_LOCAL_PROP_HANDLER,
+      [OP_ADD_LOCAL_CONSTANT] = &&OP_ADD_LOCAL_CONSTANT_HANDLER,
+      [OP_SUBTRACT_LOCAL_CONSTANT] = &&OP_SUBTRACT_LOCAL_CONSTANT_HANDLER,
+      [OP_LESS_LOCAL_CONSTANT] = &&OP_LESS_LOCAL_CONSTANT_HANDLER,
+      [OP_EQUAL_JUMP] = &&OP_EQUAL_JUMP_HANDLER,
+      [OP_GREATER_JUMP] = &&OP_GREATER_JUMP_HANDLER,
+      [OP_LESS_JUMP] = &&OP_LESS_JUMP_HANDLER,
+      [OP_ADD_NUM] = &&OP_ADD_NUM_HANDLER,
+      [OP_GET_PROP_CACHED] = &&OP_GET_PROP_CACHED_HANDLER,
+      [OP_SET_PROP_CACHED] = &&OP_SET_PROP_CACHED_HANDLER,
+  };
+#define SWITCH DISPATCH();
+#define CASE(op) op##_HANDLER:
+#define DISPATCH() goto *dispatchTable[instruction = READ_BYTE()]
+#else
+#define SWITCH switch (instruction = READ_BYTE())
+#define CASE(op) case op:
+#define DISPATCH() break
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
   debug("## EXECUTION TRACE START ##\n");
 #endif
@@ -395,322 +920,464 @@ static InterpretResult run() {
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
     printf("          ");
-    for (int i = 0; i < vm.stack.count; i++) {
+    for (Value *slot = vm.stack.values; slot < sp; slot++) {
       printf("[ ");
-      printValue(vm.stack.values[i]);
+      printValue(*slot);
       printf(" ]");
     }
     printf("\n");
     ObjFunction *callee = GET_CALLEE(frame);
     disassembleInstruction(&callee->chunk, (int)(ip - callee->chunk.code));
 #endif
+#ifdef DEBUG_OPCODE_STATS
+    countOpcode(*ip);
+#endif
 
     uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      push(READ_CONSTANT());
-      break;
-    case OP_CONSTANT_LONG:
-      push(READ_LONG_CONSTANT());
-      break;
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_GET_PROP:
-    case OP_GET_PROP_LONG: {
-      if (!IS_INSTANCE(peek(0))) {
+    SWITCH {
+    CASE(OP_CONSTANT) {
+      PUSH(READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_CONSTANT_LONG)
+      PUSH(READ_LONG_CONSTANT());
+      DISPATCH();
+    CASE(OP_NIL)
+      PUSH(NIL_VAL);
+      DISPATCH();
+    CASE(OP_TRUE)
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    CASE(OP_FALSE)
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    CASE(OP_GET_LOCAL_PROP)
+      PUSH(slots[READ_BYTE()]);
+      ip++;
+      instruction = OP_GET_PROP;
+      // Falls through to the OP_GET_PROP it stands for
+    CASE(OP_GET_PROP)
+    CASE(OP_GET_PROP_LONG) {
+      if (!IS_INSTANCE(PEEK(0))) {
         frame->ip = ip;
         runtimeError("Only instances have properties.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      ObjInstance *instance = AS_INSTANCE(peek(0));
+      ObjInstance *instance = AS_INSTANCE(PEEK(0));
       ObjString *name =
           instruction == OP_GET_PROP ? READ_STRING() : READ_STRING_LONG();
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = findCacheEntry(cache, instance->klass);
       Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        pop();
-        push(value);
-      } else if (!bindMethod(instance->klass, name)) {
-        push(NIL_VAL);
+      int slot;
+      if (isCachedField(entry, instance, name)) {
+        PEEK(0) = instance->fields.entries[entry->slot].value;
+        QUICKEN_FIELD(OP_GET_PROP, OP_GET_PROP_CACHED);
+      } else if (isCachedMethod(entry, instance)) {
+        STORE_SP();
+        bindReceiver(entry->method);
+      } else if (tableGetSlot(&instance->fields, name, &value, &slot)) {
+        cacheSlot(cache, instance->klass, slot);
+        PEEK(0) = value;
+        QUICKEN_FIELD(OP_GET_PROP, OP_GET_PROP_CACHED);
+      } else {
+        Obj *method = findMethod(instance->klass, name, cache->selector);
+        if (method != nullptr) {
+          cacheMethod(cache, instance->klass, method);
+          STORE_SP();
+          bindReceiver(method);
+        } else {
+          PEEK(0) = NIL_VAL;
+        }
       }
-      break;
+      DISPATCH();
     }
-    case OP_GET_PROP_STR: {
+    CASE(OP_GET_PROP_CACHED) {
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = &cache->entries[0];
+      if (IS_INSTANCE(PEEK(0)) &&
+          AS_INSTANCE(PEEK(0))->klass == entry->klass &&
+          isCachedField(entry, AS_INSTANCE(PEEK(0)), name)) {
+        PEEK(0) = AS_INSTANCE(PEEK(0))->fields.entries[entry->slot].value;
+        DISPATCH();
+      }
+      // Back to OP_GET_PROP, which runs the instruction again
+      ip -= 4;
+      *ip = OP_GET_PROP;
+      DISPATCH();
+    }
+    CASE(OP_GET_PROP_STR) {
+      STORE_SP();
       if (!IS_INSTANCE(peek(1))) {
         frame->ip = ip;
         runtimeError("Only instances have properties.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjInstance *instance = AS_INSTANCE(peek(1));
-      ObjString *name = AS_STRING(pop());
+      ObjString *name = internText(peek(0));
+      pop();
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = findCacheEntry(cache, instance->klass);
       Value value;
+      int slot;
       pop();
-      if (tableGet(&instance->fields, name, &value)) {
+      if (isCachedField(entry, instance, name)) {
+        push(instance->fields.entries[entry->slot].value);
+      } else if (tableGetSlot(&instance->fields, name, &value, &slot)) {
+        cacheSlot(cache, instance->klass, slot);
         push(value);
       } else {
         push(NIL_VAL);
       }
-      break;
+      LOAD_SP();
+      DISPATCH();
     }
-    case OP_SET_PROP:
-    case OP_SET_PROP_LONG: {
-      if (!IS_INSTANCE(peek(1))) {
+    CASE(OP_SET_PROP)
+    CASE(OP_SET_PROP_LONG) {
+      if (!IS_INSTANCE(PEEK(1))) {
         frame->ip = ip;
         runtimeError("Only instances have fields.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      ObjInstance *instance = AS_INSTANCE(peek(1));
+      ObjInstance *instance = AS_INSTANCE(PEEK(1));
       ObjString *name =
           instruction == OP_SET_PROP ? READ_STRING() : READ_STRING_LONG();
-      if (!IS_NIL(peek(0))) {
-        tableSet(&instance->fields, name, peek(0));
-      } else {
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = findCacheEntry(cache, instance->klass);
+      if (IS_NIL(PEEK(0))) {
         tableDelete(&instance->fields, name);
+      } else if (isCachedField(entry, instance, name)) {
+        instance->fields.entries[entry->slot].value = PEEK(0);
+        QUICKEN_FIELD(OP_SET_PROP, OP_SET_PROP_CACHED);
+      } else {
+        STORE_SP();
+        cacheSlot(cache, instance->klass, setField(instance, name, PEEK(0)));
+        QUICKEN_FIELD(OP_SET_PROP, OP_SET_PROP_CACHED);
       }
-      Value value = pop();
-      pop();
-      push(value);
-      break;
+      Value value = POP();
+      PEEK(0) = value;
+      DISPATCH();
+    }
+    CASE(OP_SET_PROP_CACHED) {
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = &cache->entries[0];
+      // Setting nil deletes the field, which only OP_SET_PROP does
+      if (IS_INSTANCE(PEEK(1)) && !IS_NIL(PEEK(0)) &&
+          AS_INSTANCE(PEEK(1))->klass == entry->klass &&
+          isCachedField(entry, AS_INSTANCE(PEEK(1)), name)) {
+        AS_INSTANCE(PEEK(1))->fields.entries[entry->slot].value = PEEK(0);
+        Value value = POP();
+        PEEK(0) = value;
+        DISPATCH();
+      }
+      ip -= 4;
+      *ip = OP_SET_PROP;
+      DISPATCH();
     }
-    case OP_SET_PROP_STR: {
+    CASE(OP_SET_PROP_STR) {
+      STORE_SP();
       if (!IS_INSTANCE(peek(2))) {
         frame->ip = ip;
         runtimeError("Only instances have fields.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjInstance *instance = AS_INSTANCE(peek(2));
-      ObjString *name = AS_STRING(peek(1));
-      if (!IS_NIL(peek(0))) {
-        tableSet(&instance->fields, name, peek(0));
+      ObjString *name = internText(peek(1));
+      // A key that had to be copied to be interned is only held by the
+      // intern table, which does not keep it alive while setField allocates
+      push(OBJ_VAL(name));
+      if (!IS_NIL(peek(1))) {
+        setField(instance, name, peek(1));
       } else {
         tableDelete(&instance->fields, name);
       }
+      pop();
       Value value_set_prop_str = pop();
       pop();
       pop();
       push(value_set_prop_str);
-      break;
+      LOAD_SP();
+      DISPATCH();
     }
-    case OP_GET_SUPER:
-    case OP_GET_SUPER_LONG: {
+    CASE(OP_GET_SUPER)
+    CASE(OP_GET_SUPER_LONG) {
       ObjString *name =
           instruction == OP_GET_SUPER ? READ_STRING() : READ_STRING_LONG();
-      ObjClass *superclass = AS_CLASS(pop());
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_SP();
       if (!bindMethod(superclass, name))
         return INTERPRET_RUNTIME_ERROR;
-      break;
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value a = pop();
-      Value b = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+    CASE(OP_EQUAL) {
+      // Comparing ropes pushes them while it flattens
+      STORE_SP();
+      Value a = POP();
+      Value b = POP();
+      PUSH(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
     }
-    case OP_CMP: {
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, peek(0))));
-      break;
+    CASE(OP_EQUAL_JUMP) {
+      STORE_SP();
+      bool equal = valuesEqual(PEEK(1), PEEK(0));
+      sp -= 2;
+      COMPARE_JUMP(equal);
+      DISPATCH();
     }
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL: {
+    CASE(OP_CMP) {
+      // Replaces the case value with the result and keeps the switch value
+      STORE_SP();
+      bool equal = valuesEqual(PEEK(0), PEEK(1));
+      PEEK(0) = BOOL_VAL(equal);
+      DISPATCH();
+    }
+    CASE(OP_POP)
+      sp--;
+      DISPATCH();
+    CASE(OP_GET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      push(stackGet(&vm.stack, frame->stackIndex + slot));
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_GET_LOCAL_2)
+      PUSH(slots[READ_BYTE()]);
+      ip++;
+      PUSH(slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_SET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      stackSet(&vm.stack, frame->stackIndex + slot, peek(0));
-      break;
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL:
-    case OP_GET_GLOBAL_LONG: {
-      ObjString *name =
-          instruction == OP_GET_GLOBAL ? READ_STRING() : READ_STRING_LONG();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
+    CASE(OP_GET_GLOBAL)
+    CASE(OP_GET_GLOBAL_LONG) {
+      int slot = instruction == OP_GET_GLOBAL ? READ_BYTE() : READ_SHORT();
+      Value value = globals[slot];
+      if (IS_UNDEFINED(value)) {
         frame->ip = ip;
+        ObjString *name = globalName(slot);
         runtimeError("Undefined variable '%.*s'.", name->length,
                      getCString(name));
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL:
-    case OP_DEFINE_GLOBAL_LONG: {
-      ObjString *name =
-          instruction == OP_DEFINE_GLOBAL ? READ_STRING() : READ_STRING_LONG();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+    CASE(OP_DEFINE_GLOBAL)
+    CASE(OP_DEFINE_GLOBAL_LONG) {
+      int slot = instruction == OP_DEFINE_GLOBAL ? READ_BYTE() : READ_SHORT();
+      globals[slot] = POP();
+      DISPATCH();
     }
-    case OP_SET_GLOBAL:
-    case OP_SET_GLOBAL_LONG: {
-      ObjString *name =
-          instruction == OP_SET_GLOBAL ? READ_STRING() : READ_STRING_LONG();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
+    CASE(OP_SET_GLOBAL)
+    CASE(OP_SET_GLOBAL_LONG) {
+      int slot = instruction == OP_SET_GLOBAL ? READ_BYTE() : READ_SHORT();
+      if (IS_UNDEFINED(globals[slot])) {
         frame->ip = ip;
+        ObjString *name = globalName(slot);
         runtimeError("Undefined variable '%.*s'.", name->length,
                      getCString(name));
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      globals[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    CASE(OP_GET_UPVALUE) {
       uint8_t slot = READ_BYTE();
       ObjUpvalue *upvalue = frame->as.closure->upvalues[slot];
       if (upvalue->stackIndex != -1) {
-        push(vm.stack.values[upvalue->stackIndex]);
+        PUSH(vm.stack.values[upvalue->stackIndex]);
       } else {
-        push(upvalue->closed);
+        PUSH(upvalue->closed);
       }
-      break;
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
+    CASE(OP_SET_UPVALUE) {
       uint8_t slot = READ_BYTE();
-      frame->as.closure->upvalues[slot]->stackIndex = vm.stack.count - 1;
-      break;
+      frame->as.closure->upvalues[slot]->stackIndex =
+          (int)(sp - vm.stack.values) - 1;
+      DISPATCH();
     }
-    case OP_GREATER:
+    CASE(OP_GREATER)
       BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
+      DISPATCH();
+    CASE(OP_LESS)
       BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_ADD:
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-        concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+      DISPATCH();
+    CASE(OP_LESS_LOCAL_CONSTANT)
+      LOCAL_CONSTANT_OP(BOOL_VAL, <);
+      DISPATCH();
+    CASE(OP_GREATER_JUMP)
+      NUMBER_COMPARE_JUMP(>);
+      DISPATCH();
+    CASE(OP_LESS_JUMP)
+      NUMBER_COMPARE_JUMP(<);
+      DISPATCH();
+    CASE(OP_ADD)
+      if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1))) {
+        frame->ip = ip;
+        STORE_SP();
+        if (!concatenate())
+          return INTERPRET_RUNTIME_ERROR;
+        LOAD_SP();
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
+        ip[-1] = OP_ADD_NUM;
       } else {
         frame->ip = ip;
         runtimeError("Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
-    case OP_SUBTRACT:
+      DISPATCH();
+    CASE(OP_ADD_NUM)
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        // Back to OP_ADD, which runs the instruction again
+        *--ip = OP_ADD;
+        DISPATCH();
+      }
+      double sum = AS_NUMBER(PEEK(1)) + AS_NUMBER(PEEK(0));
+      sp--;
+      PEEK(0) = NUMBER_VAL(sum);
+      DISPATCH();
+    CASE(OP_ADD_LOCAL_CONSTANT)
+      LOCAL_CONSTANT_OP(NUMBER_VAL, +);
+      DISPATCH();
+    CASE(OP_SUBTRACT)
       BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
+      DISPATCH();
+    CASE(OP_SUBTRACT_LOCAL_CONSTANT)
+      LOCAL_CONSTANT_OP(NUMBER_VAL, -);
+      DISPATCH();
+    CASE(OP_MULTIPLY)
       BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
+      DISPATCH();
+    CASE(OP_DIVIDE)
       BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
+      DISPATCH();
+    CASE(OP_NOT)
+      PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    CASE(OP_NEGATE)
+      if (!IS_NUMBER(PEEK(0))) {
         frame->ip = ip;
         runtimeError("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_PRINT:
-      printValue(pop());
-      printf("\n");
-      break;
-    case OP_JUMP:
+      PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    CASE(OP_PRINT)
+      writeValue(&vm.output, POP());
+      writeOutput(&vm.output, "\n", 1);
+#ifdef DEBUG_TRACE_EXECUTION
+      // Keeps the output in step with the trace
+      flushOutput(&vm.output);
+#endif
+      DISPATCH();
+    CASE(OP_JUMP)
       uint16_t offset_j = READ_SHORT();
       ip += offset_j;
-      break;
-    case OP_JUMP_IF_FALSE:
+      DISPATCH();
+    CASE(OP_JUMP_IF_FALSE)
       uint16_t offset_jif = READ_SHORT();
-      if (isFalsey(peek(0)))
+      if (isFalsey(PEEK(0)))
         ip += offset_jif;
-      break;
-    case OP_LOOP:
+      DISPATCH();
+    CASE(OP_LOOP)
       uint16_t offset_loop = READ_SHORT();
       ip -= offset_loop;
-      break;
-    case OP_CALL:
+      DISPATCH();
+    CASE(OP_CALL)
       int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount)) {
+      STORE_SP();
+      if (!callValue(PEEK(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
+      LOAD_SP();
       frame->ip = ip;
-      frame = &vm.frames[vm.frameCount - 1];
-      ip = frame->ip;
-      break;
-    case OP_INVOKE:
-    case OP_INVOKE_LONG: {
+      LOAD_FRAME();
+      DISPATCH();
+    CASE(OP_INVOKE)
+    CASE(OP_INVOKE_LONG) {
       ObjString *method =
           instruction == OP_INVOKE ? READ_STRING() : READ_STRING_LONG();
       int argCout = READ_BYTE();
-      if (!invoke(method, argCout))
+      STORE_SP();
+      if (!invoke(method, argCout, READ_CACHE()))
         return INTERPRET_RUNTIME_ERROR;
+      LOAD_SP();
       frame->ip = ip;
-      frame = &vm.frames[vm.frameCount - 1];
-      ip = frame->ip;
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_SUPER_INVOKE:
-    case OP_SUPER_INVOKE_LONG: {
+    CASE(OP_SUPER_INVOKE)
+    CASE(OP_SUPER_INVOKE_LONG) {
       ObjString *method =
           instruction == OP_SUPER_INVOKE ? READ_STRING() : READ_STRING_LONG();
       int argCount = READ_BYTE();
-      ObjClass *superclass = AS_CLASS(pop());
-      if (!invokeFromClass(superclass, method, argCount))
+      InlineCache *cache = READ_CACHE();
+      ObjClass *superclass = AS_CLASS(POP());
+      CacheEntry *entry = findCacheEntry(cache, superclass);
+      STORE_SP();
+      if (entry != nullptr && entry->method != nullptr) {
+        if (!call(entry->method, argCount))
+          return INTERPRET_RUNTIME_ERROR;
+      } else if (!invokeFromClass(superclass, method, argCount, cache)) {
         return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_SP();
       frame->ip = ip;
-      frame = &vm.frames[vm.frameCount - 1];
-      ip = frame->ip;
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
+    CASE(OP_CLOSURE) {
       ObjFunction *fun = AS_FUNCTION(READ_CONSTANT());
+      STORE_SP();
       ObjClosure *closure = newClosure(fun);
       push(OBJ_VAL(closure));
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
         if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->stackIndex + index);
+          closure->upvalues[i] = captureUpvalue((int)(slots - vm.stack.values) + index);
         } else {
           closure->upvalues[i] = frame->as.closure->upvalues[index];
         }
       }
-      break;
+      LOAD_SP();
+      DISPATCH();
     }
-    case OP_CLOSURE_LONG: {
+    CASE(OP_CLOSURE_LONG) {
       ObjFunction *fun = AS_FUNCTION(READ_LONG_CONSTANT());
+      STORE_SP();
       ObjClosure *closure = newClosure(fun);
       push(OBJ_VAL(closure));
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
         if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->stackIndex + index);
+          closure->upvalues[i] = captureUpvalue((int)(slots - vm.stack.values) + index);
         } else {
           closure->upvalues[i] = frame->as.closure->upvalues[index];
         }
       }
-      break;
+      LOAD_SP();
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE:
-      closeUpvalue(vm.stack.count - 1);
-      pop();
-      break;
-    case OP_RETURN:
-      Value result = pop();
-      closeUpvalue(frame->stackIndex);
+    CASE(OP_CLOSE_UPVALUE)
+      closeUpvalue((int)(sp - vm.stack.values) - 1);
+      sp--;
+      DISPATCH();
+    CASE(OP_RETURN)
+      Value result = POP();
+      closeUpvalue((int)(slots - vm.stack.values));
       vm.frameCount--;
 
       if (vm.frameCount == 0) {
-        pop();
+        sp--;
+        STORE_SP();
 
 #ifdef DEBUG_TRACE_EXECUTION
         debug("## EXECUTION TRACE END ##\n");
@@ -719,40 +1386,62 @@ static InterpretResult run() {
         return INTERPRET_OK;
       }
 
-      stackReset(&vm.stack, frame->stackIndex);
-      push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      ip = frame->ip;
-      break;
-    case OP_CLASS:
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
-    case OP_CLASS_LONG:
-      push(OBJ_VAL(newClass(READ_STRING_LONG())));
-      break;
-    case OP_INHERIT: {
-      Value superclass = peek(1);
+      sp = slots;
+      PUSH(result);
+      LOAD_FRAME();
+      DISPATCH();
+    CASE(OP_CLASS)
+      STORE_SP();
+      PUSH(OBJ_VAL(newClass(READ_STRING())));
+      DISPATCH();
+    CASE(OP_CLASS_LONG)
+      STORE_SP();
+      PUSH(OBJ_VAL(newClass(READ_STRING_LONG())));
+      DISPATCH();
+    CASE(OP_INHERIT) {
+      Value superclass = PEEK(1);
       if (!IS_CLASS(superclass)) {
         frame->ip = ip;
         runtimeError("Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      ObjClass *sublcass = AS_CLASS(peek(0));
-      tableAddAll(&AS_CLASS(superclass)->methods, &sublcass->methods);
-      pop();
-      break;
+      ObjClass *sublcass = AS_CLASS(PEEK(0));
+      STORE_SP();
+      inheritMethods(sublcass, AS_CLASS(superclass));
+      sp--;
+      DISPATCH();
     }
-    case OP_METHOD:
+    CASE(OP_METHOD)
+      STORE_SP();
       defineMethod(READ_STRING());
-      break;
-    case OP_METHOD_LONG:
+      LOAD_SP();
+      DISPATCH();
+    CASE(OP_METHOD_LONG)
+      STORE_SP();
       defineMethod(READ_STRING_LONG());
-      break;
-    case OP_INIT:
+      LOAD_SP();
+      DISPATCH();
+    CASE(OP_INIT)
+      STORE_SP();
       defineMethod(vm.initString);
-      break;
-
+      LOAD_SP();
+      DISPATCH();
+
+#undef DISPATCH
+#undef CASE
+#undef SWITCH
+#undef NUMBER_COMPARE_JUMP
+#undef QUICKEN_FIELD
+#undef COMPARE_JUMP
+#undef LOCAL_CONSTANT_OP
 #undef BINARY_OP
+#undef LOAD_FRAME
+#undef LOAD_SP
+#undef STORE_SP
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef READ_CACHE
 #undef READ_STRING_LONG
 #undef READ_STRING
 #undef READ_LONG_CONSTANT
@@ -774,5 +1463,7 @@ InterpretResult interpret(const char *source) {
   push(OBJ_VAL(fun));
   callFunction(fun, 0);
 
-  return run();
+  InterpretResult result = run();
+  flushOutput(&vm.output);
+  return result;
 }
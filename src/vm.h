@@ -4,10 +4,12 @@
 #include "chunk.h"
 #include "debug.h"
 #include "object.h"
+#include "output.h"
 #include "stack.h"
 #include "table.h"
 
 #define FRAMES_MAX 64
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
 #define GET_CALLEE(frame) (frame->type == CALLEE_CLOSURE ? frame->as.closure->function : frame->as.function)
 
@@ -23,16 +25,26 @@ typedef struct {
     ObjFunction *function;
   } as;
   uint8_t *ip;
-  int stackIndex;
+  // The callee's constants and the frame's first stack slot, so loading a
+  // constant or a local is a single index
+  Value *constants;
+  Value *slots;
 } CallFrame;
 
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
   Stack stack;
+  // Globals live in slots assigned at compile time; the table maps each name
+  // to its slot for the compiler and natives
   Table globals;
+  ValueArray globalValues;
   Table strings;
   ObjString *initString;
+  // Method names are interned to small selector ids indexing class methods
+  Table selectors;
+  int selectorCount;
+  int cacheSites[CACHE_MEGAMORPHIC + 1];
   ObjUpvalue *openUpvalues;
   size_t bytesAllocated;
   size_t nextGC;
@@ -41,6 +53,7 @@ typedef struct {
   int grayCapacity;
   Obj **grayStack;
   bool markValue;
+  Output output;
 } VM;
 
 typedef enum {
@@ -54,6 +67,10 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+int globalSlot(ObjString *name);
+ObjString *globalName(int slot);
+int methodSelector(ObjString *name);
+int findSelector(ObjString *name);
 void push(Value value);
 Value pop();
 